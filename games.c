@@ -15,6 +15,11 @@
 #include <wayland-cursor.h>
 #include <xkbcommon/xkbcommon.h>
 
+#include "input.h"
+#include "prof.h"
+#include "rng.h"
+#include "sudoku.h"
+#include "tetris.h"
 #include "main.h"
 
 _Static_assert(GAMES_COUNT == 6, "update this");
@@ -27,10 +32,12 @@ _Static_assert(GAMES_COUNT == 6, "update this");
 	X(breakout)
 
 #define X(name) \
-	static void name ## _UpdateDraw(struct State *state, struct Input input, double dt); \
+	static void name ## _Update(struct State *state, const struct Input *input); \
+	static void name ## _Draw(struct State *state, double alpha); \
 	static void name ## _Init(struct State *state); \
 	static void name ## _Fini(struct State *state); \
-	static void name ## _Preview(struct State *state, int x, int y, int size);
+	static void name ## _Preview(struct State *state, int x, int y, int size); \
+	static double name ## _NextTick(struct State *state);
 
 LIST_OF_GAMES
 
@@ -39,10 +46,12 @@ LIST_OF_GAMES
 struct GameInterface games[GAMES_COUNT] = {
 #define X(name) {\
 		# name, \
-		name ## _UpdateDraw, \
+		name ## _Update, \
+		name ## _Draw, \
 		name ## _Init, \
 		name ## _Fini, \
 		name ## _Preview, \
+		name ## _NextTick, \
 	},
 
 	LIST_OF_GAMES
@@ -102,6 +111,73 @@ clearBuffer(struct Buffer *buf, struct Color c)
 	cairo_restore(buf->cr);
 }
 
+static struct Rect
+rectUnion(struct Rect a, struct Rect b)
+{
+	int x1 = a.x + a.w > b.x + b.w ? a.x + a.w : b.x + b.w;
+	int y1 = a.y + a.h > b.y + b.h ? a.y + a.h : b.y + b.h;
+	struct Rect r = {
+		.x = a.x < b.x ? a.x : b.x,
+		.y = a.y < b.y ? a.y : b.y,
+	};
+	r.w = x1 - r.x;
+	r.h = y1 - r.y;
+	return r;
+}
+
+// Marks a part of the buffer (in pixels) as changed since the last frame.
+static void
+addDamage(struct State *state, double x, double y, double w, double h)
+{
+	// grow by a pixel on each side to cover antialiasing.
+	struct Rect r = {
+		.x = (int)floor(x) - 1,
+		.y = (int)floor(y) - 1,
+	};
+	r.w = (int)ceil(x + w) + 1 - r.x;
+	r.h = (int)ceil(y + h) + 1 - r.y;
+
+	if (state->damage.all)
+		return;
+	if (state->damage.len < MAX_DAMAGE_RECTS) {
+		state->damage.rects[state->damage.len++] = r;
+		return;
+	}
+
+	// Out of space, merge everything into one rectangle.
+	struct Rect *rects = state->damage.rects;
+	for (int i = 1; i < state->damage.len; i++) {
+		rects[0] = rectUnion(rects[0], rects[i]);
+	}
+	rects[0] = rectUnion(rects[0], r);
+	state->damage.len = 1;
+}
+
+// For changes that aren't worth tracking, this sticks for the rest of the
+// frame even if later updates add rectangles.
+static void
+damageAll(struct State *state)
+{
+	state->redraw = true;
+	state->damage.all = true;
+}
+
+// Whether the whole buffer is going to be damaged this frame anyway, a
+// redraw without any rectangles damages everything.
+static bool
+damagedAll(struct State *state)
+{
+	return state->damage.all || (state->redraw && state->damage.len == 0);
+}
+
+// Same as addDamage, but takes a rectangle in game units.
+static void
+addDamageF(struct State *state, struct FRect r, int xoff, int yoff, float scale)
+{
+	addDamage(state, r.x * scale + xoff, r.y * scale + yoff,
+			r.w * scale, r.h * scale);
+}
+
 static double
 lerp(double a, double b, double t)
 {
@@ -144,19 +220,174 @@ scaleAndCenterRect(int dst_width, int dst_height, int src_width,
 	}
 }
 
+// The i-th segment behind the head.
+static struct Vec2 *
+snake_Tail(struct Snake *s, int i)
+{
+	return &s->tails.data[(s->tails.head + i) % s->tails.cap];
+}
+
+static bool
+snake_Occupied(struct Snake *s, struct Vec2 v)
+{
+	int i = v.y * s->cols + v.x;
+	return s->occupied[i / 64] & ((uint64_t)1 << (i % 64));
+}
+
+static void
+snake_SetOccupied(struct Snake *s, struct Vec2 v, bool occupied)
+{
+	int i = v.y * s->cols + v.x;
+	if (occupied)
+		s->occupied[i / 64] |= (uint64_t)1 << (i % 64);
+	else
+		s->occupied[i / 64] &= ~((uint64_t)1 << (i % 64));
+}
+
+static void
+snake_ClearOccupied(struct Snake *s)
+{
+	size_t words = ((size_t)s->rows * s->cols + 63) / 64;
+	memset(s->occupied, 0, words * sizeof(*s->occupied));
+	snake_SetOccupied(s, (struct Vec2){s->x, s->y}, true);
+}
+
+static void
+snake_PushFront(struct Snake *s, struct Vec2 v)
+{
+	if (s->tails.len + 1 > s->tails.cap) {
+		int cap = s->tails.cap ? s->tails.cap * 2 : 16;
+		struct Vec2 *data = erealloc(NULL, sizeof(*data) * cap);
+		// unroll the ring so head ends up at 0 again.
+		for (int i = 0; i < s->tails.len; i++) {
+			data[i] = *snake_Tail(s, i);
+		}
+		free(s->tails.data);
+		s->tails.data = data;
+		s->tails.cap = cap;
+		s->tails.head = 0;
+	}
+	s->tails.head = (s->tails.head - 1 + s->tails.cap) % s->tails.cap;
+	s->tails.data[s->tails.head] = v;
+	s->tails.len++;
+}
+
+static struct Vec2
+snake_PopBack(struct Snake *s)
+{
+	assert(s->tails.len > 0);
+	s->tails.len--;
+	return *snake_Tail(s, s->tails.len);
+}
+
+// Places the apple on a random free cell, returns false if there is none.
+static bool
+snake_SpawnApple(struct Snake *s)
+{
+	int cells = s->rows * s->cols;
+	int freeCells = cells - (s->tails.len + 1);
+	if (freeCells <= 0)
+		return false;
+
+	// Guessing is fast while the board is mostly empty, which is nearly
+	// always.
+	for (int tries = 0; tries < 16; tries++) {
+		struct Vec2 v = {
+			rng_range(&s->rng, s->cols),
+			rng_range(&s->rng, s->rows),
+		};
+		if (!snake_Occupied(s, v)) {
+			s->apple = v;
+			return true;
+		}
+	}
+
+	// Otherwise pick the n-th free cell, counting whole words at a time.
+	int n = rng_range(&s->rng, freeCells);
+	int words = (cells + 63) / 64;
+	for (int w = 0; w < words; w++) {
+		uint64_t empty = ~s->occupied[w];
+		if (w == words - 1 && cells % 64 != 0)
+			empty &= ((uint64_t)1 << (cells % 64)) - 1;
+		int count = __builtin_popcountll(empty);
+		if (n >= count) {
+			n -= count;
+			continue;
+		}
+		for (; n > 0; n--) {
+			empty &= empty - 1;
+		}
+		int i = w * 64 + __builtin_ctzll(empty);
+		s->apple = (struct Vec2){i % s->cols, i / s->cols};
+		return true;
+	}
+	assert(0 && "unreachable");
+	return false;
+}
+
+// Premultiplied ARGB32, the format of cairo image surfaces.
+static uint32_t
+colorPixel(struct Color c)
+{
+	return (uint32_t)(c.a * 255) << 24 |
+		(uint32_t)(c.r * c.a * 255) << 16 |
+		(uint32_t)(c.g * c.a * 255) << 8 |
+		(uint32_t)(c.b * c.a * 255);
+}
+
+// serial is the move on which the segment was the head.
+static struct Color
+snake_SegmentColor(int serial)
+{
+	int n = serial % 64;
+	double c = (n < 32 ? n : 64 - n) / 32.0;
+	return (struct Color){c * 0.8, 0.2, (1 - c) * 0.8 + 0.2, 1};
+}
+
+static void
+snake_SetCell(struct Snake *s, struct Vec2 v, struct Color c)
+{
+	cairo_surface_flush(s->board);
+	uint8_t *data = cairo_image_surface_get_data(s->board);
+	int stride = cairo_image_surface_get_stride(s->board);
+	((uint32_t *)(data + v.y * stride))[v.x] = colorPixel(c);
+	cairo_surface_mark_dirty_rectangle(s->board, v.x, v.y, 1, 1);
+}
+
+// Redraws every cell of the board, only needed when a game starts.
+static void
+snake_PaintBoard(struct State *state, struct Snake *s)
+{
+	cairo_t *cr = cairo_create(s->board);
+	cairo_set_source_rgba(cr, COLOR_CAIRO(state->colors[COLOR_GREEN]));
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+
+	for (int i = 0; i < s->tails.len; i++) {
+		snake_SetCell(s, *snake_Tail(s, i), snake_SegmentColor(s->moves - i));
+	}
+	if (s->apple.x >= 0 && s->apple.y >= 0) {
+		snake_SetCell(s, s->apple, state->colors[COLOR_RED]);
+	}
+	snake_SetCell(s, (struct Vec2){s->x, s->y}, state->colors[COLOR_BLUE]);
+}
+
 static void
 snake_HandleKey(struct State *state, xkb_keysym_t key)
 {
 	struct Snake *s = &state->snake;
 	switch (key) {
 	case XKB_KEY_r:
-		state->redraw = true;
+		damageAll(state);
 		s->pause = false;
 		s->lost = false;
 		s->tails.len = 0;
+		snake_ClearOccupied(s);
+		snake_PaintBoard(state, s);
 		break;
 	case XKB_KEY_space:
-		state->redraw = true;
+		damageAll(state);
 		s->pause = !s->pause;
 		break;
 	case XKB_KEY_Left: // fallthrough
@@ -183,11 +414,11 @@ snake_HandleKey(struct State *state, xkb_keysym_t key)
 }
 
 static void
-snake_Draw(struct State *state, struct Snake *s)
+snake_DrawBoard(struct State *state, struct Snake *s)
 {
-	struct Buffer *buf = &state->buffer;
+	PROF_BEGIN(state, "snake draw");
+	struct Buffer *buf = state->buffer;
 	cairo_t *cr = buf->cr;
-	clearBuffer(buf, state->bg);
 
 	int xoff = 0, yoff = 0;
 	float scale = 1;
@@ -195,35 +426,13 @@ snake_Draw(struct State *state, struct Snake *s)
 	cairo_set_source_rgba(cr, COLOR_CAIRO(state->colors[COLOR_CYAN]));
 	cairo_paint(cr);
 
-	cairo_rectangle(cr, xoff, yoff, s->cols * scale, s->rows * scale);
-	cairo_set_source_rgba(cr, COLOR_CAIRO(state->colors[COLOR_GREEN]));
-	cairo_fill(cr);
-
-	// TODO: draw a more apple like shape.
-	if (s->apple.x >= 0 && s->apple.y >= 0) {
-		cairo_rectangle(cr,
-				s->apple.x * scale + xoff,
-				s->apple.y * scale + yoff,
-				scale, scale);
-		cairo_set_source_rgba(cr, COLOR_CAIRO(state->colors[COLOR_RED]));
-		cairo_fill(cr);
-	}
-
-	int n = 16;
-	if (n < s->tails.len)
-		n = s->tails.len;
+	cairo_save(cr);
+	cairo_scale(cr, scale, scale);
+	cairo_set_source_surface(cr, s->board, xoff/scale, yoff/scale);
+	cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+	cairo_paint(cr);
+	cairo_restore(cr);
 
-	for (int i = s->tails.len-1; i >= 0; i--) {
-		struct Vec2 *v = &s->tails.data[i];
-		cairo_rectangle(cr,
-				v->x * scale + xoff,
-				v->y * scale + yoff,
-				scale, scale);
-		// XXX: can/should we use lerpf()?
-		double c = (double)i / (double)n;
-		cairo_set_source_rgba(cr, c * 0.8, 0.2, (1 - c) * 0.8 + 0.2, 1);
-		cairo_fill(cr);
-	}
 	double x = s->x * scale + xoff;
 	double y = s->y * scale + yoff;
 
@@ -268,116 +477,56 @@ snake_Draw(struct State *state, struct Snake *s)
 	cairo_fill(cr);
 	cairo_arc(cr, x2, y2, scale * 0.1, 0, PI * 2);
 	cairo_fill(cr);
+	PROF_END(state);
+}
+
+static void
+snake_DamageCell(struct State *state, struct Snake *s, struct Vec2 v)
+{
+	struct Buffer *buf = state->buffer;
+	int xoff = 0, yoff = 0;
+	float scale = 1;
+	scaleAndCenterRect(buf->width, buf->height, s->cols, s->rows, &xoff, &yoff, &scale);
+	addDamageF(state, (struct FRect){v.x, v.y, 1, 1}, xoff, yoff, scale);
 }
 
 static void
-snake_UpdateDraw(struct State *state, struct Input input, double dt)
+snake_Update(struct State *state, const struct Input *input)
 {
-	for (size_t i = 0; i < input.keys_len; i++) {
-		if (input.keys[i].state == KEY_PRESSED) {
-			snake_HandleKey(state, input.keys[i].keysym);
+	for (size_t i = 0; i < input->keys_len; i++) {
+		if (input->keys[i].state == KEY_PRESSED) {
+			snake_HandleKey(state, input->keys[i].keysym);
 		}
 	}
+	// Anything that asked for a redraw before the snake moved changes
+	// the whole screen.
+	bool fullRedraw = damagedAll(state);
+	bool spawned = false;
 
-	static double accumTime = 0;
 	struct Snake *s = &state->snake;
-
-	static int appleSpawn = 0;
-
-render_lost:
-	if (s->lost) {
-		if (!state->redraw)
-			return;
-		snake_Draw(state, &state->snake);
-
-		struct Buffer *buf = &state->buffer;
-		cairo_t *cr = buf->cr;
-		struct Color fg = state->bg;
-
-		cairo_set_source_rgba(cr, COLOR_CAIRO(fg));
-
-		char *text = "You lost";
-		float fontSize = 0.25 * (float)buf->width;
-		cairo_text_extents_t ext;
-		cairo_set_font_size(cr, fontSize);
-		cairo_text_extents(cr, text, &ext);
-		int tx = buf->width/2 - ext.width / 2;
-		int ty = buf->height/2 + ext.height/2;
-		cairo_move_to(cr, tx, ty);
-		cairo_show_text(cr, text);
-		return;
-	}
-
-	if (s->pause) {
-		if (!state->redraw)
-			return;
-		snake_Draw(state, &state->snake);
-
-		struct Buffer *buf = &state->buffer;
-		cairo_t *cr = buf->cr;
-
-		int w = buf->width;
-		int h = buf->height;
-		int barw = 0.05 * w;
-		int barh = 0.7 * h;
-
-		cairo_set_source_rgba(cr, 0, 0, 0, 0.4);
-		cairo_paint(cr);
-
-		cairo_rectangle(cr,
-				w / 2 - barw * 2,
-				h / 2 - barh/2,
-				barw, barh);
-		cairo_rectangle(cr,
-				w / 2 + barw,
-				h / 2 - barh/2,
-				barw, barh);
-		cairo_set_source_rgba(cr, 0.9, 0.9, 0.9, 1);
-		cairo_fill(cr);
+	if (s->lost || s->pause)
 		return;
-	}
 
-	if (appleSpawn > 5) {
+	PROF_BEGIN(state, "snake update");
+	if (s->apple_spawn > 5) {
 		state->redraw = true;
 
-		appleSpawn = 0;
+		s->apple_spawn = 0;
 
-		// TODO: don't spawn inside snake;
 		if (s->apple.x < 0 || s->apple.y < 0) {
-			s->apple.x = rand() % s->cols;
-			s->apple.y = rand() % s->rows;
+			spawned = snake_SpawnApple(s);
+			if (spawned)
+				snake_SetCell(s, s->apple, state->colors[COLOR_RED]);
 		}
 	}
-	static double interval = 0.65;
-
-	if (accumTime > interval) {
+	if (s->accum_time > s->interval) {
 		state->redraw = true;
 		s->dir = s->next_dir;
 
-		accumTime = 0;
-		appleSpawn += 1;
+		s->accum_time = 0;
+		s->apple_spawn += 1;
 
-		struct Vec2 newTail = {-1, -1};
-
-		if (s->tails.len > 0) {
-			newTail = s->tails.data[s->tails.len-1];
-		} else {
-			newTail = (struct Vec2){s->x, s->y};
-		}
-
-		for (int i = s->tails.len-1; i > 0; i--) {
-			struct Vec2 *v1 = &s->tails.data[i-1];
-			struct Vec2 *v  = &s->tails.data[i];
-			*v = *v1;
-		}
-		if (s->tails.len > 0) {
-			struct Vec2 *v  = &s->tails.data[0];
-			struct Vec2 v1 = {
-				s->x,
-				s->y,
-			};
-			*v = v1;
-		}
+		struct Vec2 prevHead = {s->x, s->y};
 
 		switch (s->dir) {
 		case DIR_UP:
@@ -405,40 +554,139 @@ render_lost:
 			}
 			break;
 		}
-		for (int i = 0; i < s->tails.len; i++) {
-			if (s->x == s->tails.data[i].x && s->y == s->tails.data[i].y) {
-				s->lost = true;
-				goto render_lost;
-			}
+		struct Vec2 head = {s->x, s->y};
+
+		// The old head becomes the first segment, the end of the tail
+		// stays where it is if the snake grows and moves off its cell
+		// otherwise, before the head could run into it.
+		snake_PushFront(s, prevHead);
+		s->moves++;
+		snake_SetCell(s, prevHead, snake_SegmentColor(s->moves));
+		struct Vec2 tailEnd = *snake_Tail(s, s->tails.len-1);
+		bool ate = s->apple.x == head.x && s->apple.y == head.y;
+		if (!ate) {
+			snake_SetOccupied(s, snake_PopBack(s), false);
+			snake_SetCell(s, tailEnd, state->colors[COLOR_GREEN]);
+		}
+
+		if (snake_Occupied(s, head)) {
+			s->lost = true;
+			damageAll(state);
+			PROF_END(state);
+			return;
 		}
+		snake_SetOccupied(s, head, true);
+		snake_SetCell(s, head, state->colors[COLOR_BLUE]);
 
-		if (s->apple.x == s->x && s->apple.y == s->y) {
-			appleSpawn = 0;
+		if (ate) {
+			s->apple_spawn = 0;
 			s->apple.x = -1;
 			s->apple.y = -1;
-			if (interval > 0.15)
-				interval *= 0.9;
-			APPEND(s->tails, newTail);
+			if (s->interval > 0.15)
+				s->interval *= 0.9;
+		}
+
+		if (!fullRedraw) {
+			snake_DamageCell(state, s, tailEnd);
+			snake_DamageCell(state, s, prevHead);
+			snake_DamageCell(state, s, head);
 		}
 	}
-	accumTime += dt;
+	s->accum_time += TICK_DT;
 
-	snake_Draw(state, &state->snake);
+	if (spawned && !fullRedraw) {
+		snake_DamageCell(state, s, s->apple);
+	}
+	PROF_END(state);
+}
+
+static void
+snake_Draw(struct State *state, double alpha)
+{
+	struct Snake *s = &state->snake;
+	if (!state->redraw)
+		return;
+	snake_DrawBoard(state, s);
+
+	struct Buffer *buf = state->buffer;
+	cairo_t *cr = buf->cr;
+	if (s->lost) {
+		struct Color fg = state->bg;
+
+		cairo_set_source_rgba(cr, COLOR_CAIRO(fg));
+
+		char *text = "You lost";
+		float fontSize = 0.25 * (float)buf->width;
+		cairo_text_extents_t ext;
+		cairo_set_font_size(cr, fontSize);
+		cairo_text_extents(cr, text, &ext);
+		int tx = buf->width/2 - ext.width / 2;
+		int ty = buf->height/2 + ext.height/2;
+		cairo_move_to(cr, tx, ty);
+		cairo_show_text(cr, text);
+	} else if (s->pause) {
+		int w = buf->width;
+		int h = buf->height;
+		int barw = 0.05 * w;
+		int barh = 0.7 * h;
+
+		cairo_set_source_rgba(cr, 0, 0, 0, 0.4);
+		cairo_paint(cr);
+
+		cairo_rectangle(cr,
+				w / 2 - barw * 2,
+				h / 2 - barh/2,
+				barw, barh);
+		cairo_rectangle(cr,
+				w / 2 + barw,
+				h / 2 - barh/2,
+				barw, barh);
+		cairo_set_source_rgba(cr, 0.9, 0.9, 0.9, 1);
+		cairo_fill(cr);
+	}
 }
 
 static void
 snake_Init(struct State *state)
 {
+	int cols = state->snake_cols > 0 ? state->snake_cols : SNAKE_DEFAULT_SIZE;
+	int rows = state->snake_rows > 0 ? state->snake_rows : SNAKE_DEFAULT_SIZE;
 	state->snake = (struct Snake){
-		.x = 8,
-		.y = 8,
-		.cols = 16,
-		.rows = 16,
+		.x = cols / 2,
+		.y = rows / 2,
+		.cols = cols,
+		.rows = rows,
 		.apple = (struct Vec2){
 			.x = -1,
 			.y = -1,
 		},
+		.interval = 0.65,
+		.rng = rng_split(&state->rng),
 	};
+	struct Snake *s = &state->snake;
+	s->occupied = erealloc(NULL, ((size_t)s->rows * s->cols + 63) / 64 *
+			sizeof(*s->occupied));
+	snake_ClearOccupied(s);
+
+	s->board = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, cols, rows);
+	cairo_status_t status = cairo_surface_status(s->board);
+	if (status != CAIRO_STATUS_SUCCESS) {
+		fprintf(stderr, "snake: cairo: %s\n", cairo_status_to_string(status));
+		exit(1);
+	}
+	snake_PaintBoard(state, s);
+}
+
+static double
+snake_NextTick(struct State *state)
+{
+	struct Snake *s = &state->snake;
+	if (s->pause || s->lost)
+		return TICK_IDLE;
+	if (s->accum_time > s->interval)
+		return TICK_NOW;
+	// the snake moves once accum_time goes past the interval.
+	return s->interval - s->accum_time + 0.001;
 }
 
 static void
@@ -447,12 +695,16 @@ snake_Fini(struct State *state)
 	struct Snake *s = &state->snake;
 	free(s->tails.data);
 	memset(&s->tails, 0, sizeof(s->tails));
+	free(s->occupied);
+	s->occupied = NULL;
+	cairo_surface_destroy(s->board);
+	s->board = NULL;
 }
 
 static void
 snake_Preview(struct State *state, int x, int y, int size)
 {
-	struct Buffer *buf = &state->buffer;
+	struct Buffer *buf = state->buffer;
 	cairo_t *cr = buf->cr;
 	struct Color bg = state->bg;
 	struct Color fg = state->fg;
@@ -495,104 +747,108 @@ snake_Preview(struct State *state, int x, int y, int size)
 	cairo_fill(cr);
 }
 
+// Whether n can be in (x, y) without repeating in its row, column or box,
+// the cell itself doesn't count.
 static bool
 sudoku_IsValid(struct Sudoku *s, int x, int y, int n)
 {
 	assert(1 <= n && n <= 9);
+	// if the cell holds n itself, n is only a problem if it's there twice.
+	uint16_t (*masks)[9] = s->board[y][x].value == n ? s->dup : s->used;
+	uint16_t bit = SUDOKU_BIT(n);
+	return !((masks[SUDOKU_UNIT_ROW][y] | masks[SUDOKU_UNIT_COL][x] |
+				masks[SUDOKU_UNIT_BOX][SUDOKU_BOX(x, y)]) & bit);
+}
 
-	for (int i = 0; i < 9; i++) {
-		if (i == x)
-			continue;
-		if (s->board[y][i].value == n)
-			return false;
-	}
-	for (int i = 0; i < 9; i++) {
-		if (i == y)
-			continue;
-		if (s->board[i][x].value == n)
-			return false;
+static void
+sudoku_Count(struct Sudoku *s, int x, int y, int n, int delta)
+{
+	int units[SUDOKU_UNITS_COUNT] = {
+		[SUDOKU_UNIT_ROW] = y,
+		[SUDOKU_UNIT_COL] = x,
+		[SUDOKU_UNIT_BOX] = SUDOKU_BOX(x, y),
+	};
+	uint16_t bit = SUDOKU_BIT(n);
+	for (int u = 0; u < SUDOKU_UNITS_COUNT; u++) {
+		int i = units[u];
+		uint8_t count = s->counts[u][i][n-1] += delta;
+		s->used[u][i] = count > 0 ? s->used[u][i] | bit : s->used[u][i] & ~bit;
+		s->dup[u][i] = count > 1 ? s->dup[u][i] | bit : s->dup[u][i] & ~bit;
 	}
+}
 
-	int box_y = 3 * (y / 3);
-	int box_x = 3 * (x / 3);
-
-	for (int dy = 0; dy < 3; dy++) {
-		for (int dx = 0; dx < 3; dx++) {
-			if (box_x + dx == x && box_y + dy == y)
-				continue;
-			if (s->board[box_y + dy][box_x + dx].value == n)
-				return false;
-		}
-	}
-	return true;
+static void
+sudoku_RefreshCell(struct Sudoku *s, int x, int y)
+{
+	struct SudokuCell *cell = &s->board[y][x];
+	bool conflict = cell->value != 0 && !sudoku_IsValid(s, x, y, cell->value);
+	s->conflicts += conflict - cell->conflict;
+	cell->conflict = conflict;
+	cell->candidates = ~(s->used[SUDOKU_UNIT_ROW][y] | s->used[SUDOKU_UNIT_COL][x] |
+			s->used[SUDOKU_UNIT_BOX][SUDOKU_BOX(x, y)]) & SUDOKU_DIGITS;
 }
 
-static bool
-sudoku_FillTheRest(struct Sudoku *s)
+// Every change to a cell's value goes through here to keep the masks, and
+// the flags of every cell sharing a row, column or box with it, right.
+static void
+sudoku_SetValue(struct Sudoku *s, int x, int y, int n)
 {
-	int x, y;
-	for (y = 0; y < 9; y++) {
-		for (x = 0; x < 9; x++) {
-			if (s->board[y][x].value == 0)
-				goto found_empty;
-		}
+	struct SudokuCell *cell = &s->board[y][x];
+	if (cell->value == n)
+		return;
+	if (cell->value != 0) {
+		sudoku_Count(s, x, y, cell->value, -1);
+		s->filled--;
 	}
-	// If there's no empty space, assume we finished filling it.
-	return true;
-found_empty:
-	for (int n = 1; n <= 9; n++) {
-		if (sudoku_IsValid(s, x, y, n)) {
-			s->board[y][x].value = n;
-			if (sudoku_FillTheRest(s))
-				return true;
-			s->board[y][x].value = 0;
-		}
+	cell->value = n;
+	if (n != 0) {
+		sudoku_Count(s, x, y, n, 1);
+		s->filled++;
+	}
+
+	int box_x = 3 * (x / 3);
+	int box_y = 3 * (y / 3);
+	for (int i = 0; i < 9; i++) {
+		sudoku_RefreshCell(s, i, y);
+		sudoku_RefreshCell(s, x, i);
+		sudoku_RefreshCell(s, box_x + i % 3, box_y + i / 3);
 	}
-	return false;
 }
 
+static char *sudoku_difficulties[SUDOKU_DIFFICULTIES_COUNT] = {
+	[SUDOKU_EASY]   = "easy",
+	[SUDOKU_MEDIUM] = "medium",
+	[SUDOKU_HARD]   = "hard",
+	[SUDOKU_EXPERT] = "expert",
+};
+
+// Starts a new game with a puzzle from the pool.
 static void
-sudoku_RemoveRandom(struct Sudoku *s)
-{
-	int diff = 40;
-	int n = (rand() % diff) + diff;
-	for (int i = 0; i < n; i++) {
-		int x = rand() % 9;
-		int y = rand() % 9;
-		s->board[y][x].value = 0;
-		s->board[y][x].user_fill = true;
-	}
-}
-
-static struct Sudoku
-sudoku_Gen(void)
-{
-	struct Sudoku s = {0};
-	for (int i = 0; i < 9; i += 3) {
-		for (int dy = 0; dy < 3; dy++) {
-			for (int dx = 0; dx < 3; dx++) {
-				int x = i + dx;
-				int y = i + dy;
-				int n = rand() % 9 + 1;
-				if (!sudoku_IsValid(&s, x, y, n)) {
-					for (n = 1; n <= 9; n++) {
-						if (sudoku_IsValid(&s, x, y, n)) {
-							break;
-						}
-					}
-				}
-				assert(n != 10);
-				s.board[y][x].value = n;
-			}
+sudoku_New(struct Sudoku *s, enum SudokuDifficulty difficulty)
+{
+	struct SudokuGrid puzzle;
+	enum SudokuDifficulty grade = sudoku_pool_take(s->pool, difficulty, &puzzle);
+
+	*s = (struct Sudoku){
+		.difficulty = difficulty,
+		.grade = grade,
+		.pool = s->pool,
+		.auto_marks = s->auto_marks,
+	};
+	for (int y = 0; y < 9; y++) {
+		for (int x = 0; x < 9; x++) {
+			int n = puzzle.cells[y * 9 + x];
+			sudoku_SetValue(s, x, y, n);
+			s->board[y][x].user_fill = n == 0;
 		}
 	}
-
-	if (!sudoku_FillTheRest(&s)) {
-		assert(0 && "unreachable");
+	// empty cells without a clue in their row, column or box were never
+	// refreshed above.
+	for (int y = 0; y < 9; y++) {
+		for (int x = 0; x < 9; x++) {
+			sudoku_RefreshCell(s, x, y);
+		}
 	}
-	sudoku_RemoveRandom(&s);
-
-	return s;
 }
 
 static void
@@ -606,7 +862,14 @@ sudoku_HandleKey(struct State *state, xkb_keysym_t key, bool repeat)
 			break;
 		}
 		state->redraw = true;
-		*s = sudoku_Gen();
+		sudoku_New(s, s->difficulty);
+		break;
+	case XKB_KEY_d:
+		if (repeat) {
+			break;
+		}
+		state->redraw = true;
+		sudoku_New(s, (s->difficulty + 1) % SUDOKU_DIFFICULTIES_COUNT);
 		break;
 	case XKB_KEY_0: // fallthrough
 	case XKB_KEY_space:
@@ -615,8 +878,8 @@ sudoku_HandleKey(struct State *state, xkb_keysym_t key, bool repeat)
 		}
 		state->redraw = true;
 		if (focus->user_fill) {
-			focus->value = 0;
-			memset(focus->values, 0, sizeof(focus->values));
+			sudoku_SetValue(s, s->focus_x, s->focus_y, 0);
+			focus->marks = 0;
 		}
 		break;
 	case XKB_KEY_1: // fallthrough
@@ -637,45 +900,35 @@ sudoku_HandleKey(struct State *state, xkb_keysym_t key, bool repeat)
 		}
 		int n = key - XKB_KEY_0;
 		if (focus->value == n) {
-			focus->value = 0;
+			sudoku_SetValue(s, s->focus_x, s->focus_y, 0);
 			break;
 		}
+		uint16_t bit = SUDOKU_BIT(n);
 		if (focus->value == 0) {
-			if (focus->values[n-1]) {
-				focus->values[n-1] = false;
-				int count = 0;
-				int last = 0;
-				for (int i = 1; i <= 9; i++) {
-					if (focus->values[i-1]) {
-						count++;
-						last = i;
-					}
-				}
-				if (count == 1) {
-					focus->values[last-1] = false;
-					focus->value = last;
+			if (focus->marks & bit) {
+				focus->marks &= ~bit;
+				// a single mark left becomes the value.
+				if (focus->marks && !(focus->marks & (focus->marks - 1))) {
+					int last = __builtin_ctz(focus->marks) + 1;
+					focus->marks = 0;
+					sudoku_SetValue(s, s->focus_x, s->focus_y, last);
 				}
+			} else if (focus->marks) {
+				focus->marks |= bit;
 			} else {
-				bool exists = false;
-				for (int i = 1; i <= 9; i++) {
-					if (i == n)
-						continue;
-					if (focus->values[i-1]) {
-						exists = true;
-						break;
-					}
-				}
-				if (exists) {
-					focus->values[n-1] = true;
-				} else {
-					focus->value = n;
-				}
+				sudoku_SetValue(s, s->focus_x, s->focus_y, n);
 			}
 		} else {
-			focus->values[(int)focus->value-1] = true;
-			focus->values[n-1] = true;
-			focus->value = 0;
+			focus->marks = SUDOKU_BIT(focus->value) | bit;
+			sudoku_SetValue(s, s->focus_x, s->focus_y, 0);
+		}
+		break;
+	case XKB_KEY_c:
+		if (repeat) {
+			break;
 		}
+		state->redraw = true;
+		s->auto_marks = !s->auto_marks;
 		break;
 	case XKB_KEY_Left: // fallthrough
 	case XKB_KEY_h:
@@ -718,7 +971,7 @@ sudoku_Preview(struct State *state, int x, int y, int size)
 		[7] = {0,6,2,5,0,0,0,0,3},
 		[8] = {0,0,0,0,2,0,0,5,0},
 	};
-	struct Buffer *buf = &state->buffer;
+	struct Buffer *buf = state->buffer;
 	cairo_t *cr = buf->cr;
 	//struct Color bg = state->bg;
 	struct Color fg = state->fg;
@@ -766,21 +1019,26 @@ sudoku_Preview(struct State *state, int x, int y, int size)
 }
 
 static void
-sudoku_UpdateDraw(struct State *state, struct Input input, double dt)
+sudoku_Update(struct State *state, const struct Input *input)
 {
-	for (size_t i = 0; i < input.keys_len; i++) {
-		if (input.keys[i].state == KEY_RELEASED)
+	for (size_t i = 0; i < input->keys_len; i++) {
+		if (input->keys[i].state == KEY_RELEASED)
 			continue;
-		sudoku_HandleKey(state, input.keys[i].keysym,
-				input.keys[i].state == KEY_REPEAT);
+		sudoku_HandleKey(state, input->keys[i].keysym,
+				input->keys[i].state == KEY_REPEAT);
 	}
+}
 
+static void
+sudoku_Draw(struct State *state, double alpha)
+{
 	struct Sudoku *s = &state->sudoku;
 
 	if (!state->redraw)
 		return;
 
-	struct Buffer *buf = &state->buffer;
+	PROF_BEGIN(state, "sudoku draw");
+	struct Buffer *buf = state->buffer;
 	struct Color *fg = &state->fg;
 	struct Color *bg = &state->bg;
 	cairo_t *cr = buf->cr;
@@ -864,52 +1122,61 @@ sudoku_UpdateDraw(struct State *state, struct Input input, double dt)
 
 	double size = scale * 0.8;
 	double subSize = scale * 0.4;
-	bool completed = true;
+	if (s->ext.scale != scale) {
+		s->ext.scale = scale;
+		for (int i = 1; i <= 9; i++) {
+			char text[] = { i + '0', '\0' };
+			cairo_text_extents_t ext;
+			cairo_set_font_size(cr, size);
+			cairo_text_extents(cr, text, &ext);
+			s->ext.value[i-1] = ext.width;
+			cairo_set_font_size(cr, subSize);
+			cairo_text_extents(cr, text, &ext);
+			s->ext.mark[i-1] = ext.width;
+		}
+	}
+
+	cairo_set_font_size(cr, subSize);
 	for (int y = 0; y < rows; y++) {
 		for (int x = 0; x < cols; x++) {
-			struct Color c = *fg;
-			if (s->board[y][x].user_fill) {
-				c = *bg;
-			}
-
-			if (s->board[y][x].value == 0) {
-				completed = false;
-				int tx = xoff + x*scale;
-				bool *values = &s->board[y][x].values[0];
-				for (int i = 1; i <= 9; i++) {
-					if (values[i-1]) {
-						cairo_set_source_rgba(cr, COLOR_CAIRO(c));
-						cairo_text_extents_t ext;
-						int ty = size + yoff + y*scale;
-						char text[] = { i + '0', '\0' } ;
-						cairo_set_font_size(cr, subSize);
-						cairo_text_extents(cr, text, &ext);
-						tx += ext.width;
-						cairo_move_to(cr, tx, ty);
-						cairo_show_text(cr, text);
-					}
-				}
+			struct SudokuCell *cell = &s->board[y][x];
+			if (cell->value != 0)
 				continue;
+			struct Color c = cell->user_fill ? *bg : *fg;
+			cairo_set_source_rgba(cr, COLOR_CAIRO(c));
+			int tx = xoff + x*scale;
+			int ty = size + yoff + y*scale;
+			uint16_t marks = s->auto_marks ? cell->candidates : cell->marks;
+			for (; marks; marks &= marks - 1) {
+				int i = __builtin_ctz(marks) + 1;
+				char text[] = { i + '0', '\0' } ;
+				tx += s->ext.mark[i-1];
+				cairo_move_to(cr, tx, ty);
+				cairo_show_text(cr, text);
 			}
+		}
+	}
 
-			if (!sudoku_IsValid(s, x, y, s->board[y][x].value)) {
-				completed = false;
+	cairo_set_font_size(cr, size);
+	for (int y = 0; y < rows; y++) {
+		for (int x = 0; x < cols; x++) {
+			struct SudokuCell *cell = &s->board[y][x];
+			if (cell->value == 0)
+				continue;
+			struct Color c = cell->user_fill ? *bg : *fg;
+			if (cell->conflict)
 				c = state->colors[COLOR_RED];
-			}
 			cairo_set_source_rgba(cr, COLOR_CAIRO(c));
 
-			cairo_text_extents_t ext;
 			int ty = size + yoff + y*scale;
-			int tx = xoff + x*scale;
-			char text[] = { s->board[y][x].value + '0', '\0' } ;
-			cairo_set_font_size(cr, size);
-			cairo_text_extents(cr, text, &ext);
-			tx += ext.width;
+			int tx = xoff + x*scale + s->ext.value[cell->value-1];
+			char text[] = { cell->value + '0', '\0' } ;
 			cairo_move_to(cr, tx, ty);
 			cairo_show_text(cr, text);
 		}
 	}
 
+	bool completed = s->filled == 81 && s->conflicts == 0;
 	if (completed) {
 		char *text = "You Won";
 		cairo_text_extents_t ext;
@@ -920,25 +1187,38 @@ sudoku_UpdateDraw(struct State *state, struct Input input, double dt)
 				2 + ext.height/2);
 		cairo_show_text(cr, text);
 
-		text = "press r to create a new game, or q to quit";
+		char hint[128];
+		snprintf(hint, sizeof(hint),
+				"%s puzzle, press r to create a new game, d to change difficulty or q to quit",
+				sudoku_difficulties[s->grade]);
+		text = hint;
 		cairo_set_source_rgba(cr, COLOR_CAIRO(*bg));
-		cairo_set_font_size(cr, scale * 0.8);
+		cairo_set_font_size(cr, scale * 0.4);
 		cairo_text_extents(cr, text, &ext);
 		cairo_move_to(cr, buf->width / 2 - ext.width / 2, ext.height);
 		cairo_show_text(cr, text);
 	}
+	PROF_END(state);
 }
 
 static void
 sudoku_Init(struct State *state)
 {
-	state->sudoku = sudoku_Gen();
+	state->sudoku.pool = state->sudoku_pool;
+	sudoku_New(&state->sudoku, SUDOKU_MEDIUM);
 }
 
 static void
 sudoku_Fini(struct State *state)
 {
-	// noop
+	// the pool keeps filling for the next game.
+	state->sudoku.pool = NULL;
+}
+
+static double
+sudoku_NextTick(struct State *state)
+{
+	return TICK_IDLE;
 }
 
 static void
@@ -982,21 +1262,21 @@ pong_HandleKey(struct State *state, xkb_keysym_t key, bool released)
 }
 
 static void
-pong_UpdateDraw(struct State *state, struct Input input, double dt)
+pong_Update(struct State *state, const struct Input *input)
 {
-	for (size_t i = 0; i < input.keys_len; i++) {
-		pong_HandleKey(state, input.keys[i].keysym,
-				input.keys[i].state == KEY_RELEASED);
+	for (size_t i = 0; i < input->keys_len; i++) {
+		pong_HandleKey(state, input->keys[i].keysym,
+				input->keys[i].state == KEY_RELEASED);
 	}
 
-	struct Buffer *buf = &state->buffer;
 	struct Pong *p = &state->pong;
-	struct Color *fg = &state->fg;
-	struct Color *bg = &state->bg;
-	cairo_t *cr = buf->cr;
+	double dt = TICK_DT;
 
-	// We almost always want a redraw.
-	state->redraw = true;
+	p->prev.ball = p->ball;
+	p->prev.player1_y = p->player1_y;
+	p->prev.player2_y = p->player2_y;
+
+	PROF_BEGIN(state, "pong update");
 
 	if (p->ai) {
 		if (p->player2_y < p->ball.y) {
@@ -1018,12 +1298,14 @@ pong_UpdateDraw(struct State *state, struct Input input, double dt)
 		p->ball_velocity.x = -PONG_BALL_DX;
 		p->ball.y = PONG_HEIGHT / 2;
 		p->ball.x = PONG_WIDTH / 2;
+		p->prev.ball = p->ball;
 	}
 	if (p->ball.x - PONG_BALL_RADIUS < 0) {
 		p->score_right += 1;
 		p->ball_velocity.x = PONG_BALL_DX;
 		p->ball.y = PONG_HEIGHT / 2;
 		p->ball.x = PONG_WIDTH / 2;
+		p->prev.ball = p->ball;
 	}
 
 
@@ -1069,13 +1351,36 @@ pong_UpdateDraw(struct State *state, struct Input input, double dt)
 
 		p->ball_velocity.x *= -1.1;
 	};
-	if (fabsf(p->ball_velocity.x) > PONG_BALL_MAX_DX) {
-		if (p->ball_velocity.x < PONG_BALL_MAX_DX) {
-			p->ball_velocity.x = -PONG_BALL_MAX_DX;
-		} else {
-			p->ball_velocity.x = PONG_BALL_MAX_DX;
-		}
-	}
+	if (fabsf(p->ball_velocity.x) > PONG_BALL_MAX_DX) {
+		if (p->ball_velocity.x < PONG_BALL_MAX_DX) {
+			p->ball_velocity.x = -PONG_BALL_MAX_DX;
+		} else {
+			p->ball_velocity.x = PONG_BALL_MAX_DX;
+		}
+	}
+
+	PROF_END(state);
+}
+
+static void
+pong_Draw(struct State *state, double alpha)
+{
+	struct Buffer *buf = state->buffer;
+	struct Pong *p = &state->pong;
+	struct Color *fg = &state->fg;
+	struct Color *bg = &state->bg;
+	cairo_t *cr = buf->cr;
+
+	// Something moves between every two updates.
+	state->redraw = true;
+
+	PROF_BEGIN(state, "pong draw");
+	struct FVec2 ball = {
+		lerpf(p->prev.ball.x, p->ball.x, alpha),
+		lerpf(p->prev.ball.y, p->ball.y, alpha),
+	};
+	float player1_y = lerpf(p->prev.player1_y, p->player1_y, alpha);
+	float player2_y = lerpf(p->prev.player2_y, p->player2_y, alpha);
 
 	cairo_set_source_rgba(cr, COLOR_CAIRO(state->colors[COLOR_BLACK]));
 	cairo_paint(cr);
@@ -1091,20 +1396,20 @@ pong_UpdateDraw(struct State *state, struct Input input, double dt)
 
 	cairo_rectangle(cr,
 			PONG_PLAYER_X * scale + xoff,
-			(p->player1_y - PONG_PLAYER_HEIGHT/2) * scale + yoff,
+			(player1_y - PONG_PLAYER_HEIGHT/2) * scale + yoff,
 			PONG_PLAYER_WIDTH * scale,
 			PONG_PLAYER_HEIGHT * scale);
 	cairo_rectangle(cr,
 			(PONG_WIDTH - PONG_PLAYER_X - PONG_PLAYER_WIDTH) * scale + xoff,
-			(p->player2_y - PONG_PLAYER_HEIGHT/2) * scale + yoff,
+			(player2_y - PONG_PLAYER_HEIGHT/2) * scale + yoff,
 			PONG_PLAYER_WIDTH * scale,
 			PONG_PLAYER_HEIGHT * scale);
 	cairo_set_source_rgba(cr, COLOR_CAIRO(*fg));
 	cairo_fill(cr);
 
 	cairo_set_source_rgba(cr, COLOR_CAIRO(*fg));
-	cairo_arc(cr, p->ball.x * scale + xoff,
-			p->ball.y * scale + yoff,
+	cairo_arc(cr, ball.x * scale + xoff,
+			ball.y * scale + yoff,
 			PONG_BALL_RADIUS * scale,
 			0, PI * 2);
 	cairo_fill(cr);
@@ -1124,6 +1429,33 @@ pong_UpdateDraw(struct State *state, struct Input input, double dt)
 	tx -= ext.width/2;
 	cairo_move_to(cr, tx, ty);
 	cairo_show_text(cr, score);
+
+	// Only the ball, the paddles and the score ever change.
+	float r = PONG_BALL_RADIUS;
+	addDamageF(state, (struct FRect){p->drawn.ball.x - r, p->drawn.ball.y - r, r*2, r*2},
+			xoff, yoff, scale);
+	addDamageF(state, (struct FRect){ball.x - r, ball.y - r, r*2, r*2},
+			xoff, yoff, scale);
+	addDamageF(state, (struct FRect){
+				PONG_PLAYER_X,
+				fminf(p->drawn.player1_y, player1_y) - PONG_PLAYER_HEIGHT/2,
+				PONG_PLAYER_WIDTH,
+				fabsf(p->drawn.player1_y - player1_y) + PONG_PLAYER_HEIGHT,
+			}, xoff, yoff, scale);
+	addDamageF(state, (struct FRect){
+				PONG_WIDTH - PONG_PLAYER_X - PONG_PLAYER_WIDTH,
+				fminf(p->drawn.player2_y, player2_y) - PONG_PLAYER_HEIGHT/2,
+				PONG_PLAYER_WIDTH,
+				fabsf(p->drawn.player2_y - player2_y) + PONG_PLAYER_HEIGHT,
+			}, xoff, yoff, scale);
+	if (p->drawn_score != p->score_left + p->score_right) {
+		addDamage(state, xoff, yoff, PONG_WIDTH * scale, size * 1.5);
+	}
+	p->drawn.ball = ball;
+	p->drawn.player1_y = player1_y;
+	p->drawn.player2_y = player2_y;
+	p->drawn_score = p->score_left + p->score_right;
+	PROF_END(state);
 }
 
 static void
@@ -1144,6 +1476,11 @@ pong_Init(struct State *state)
 			.y = 80,
 		},
 	};
+	struct Pong *p = &state->pong;
+	p->prev.ball = p->ball;
+	p->prev.player1_y = p->player1_y;
+	p->prev.player2_y = p->player2_y;
+	p->drawn = p->prev;
 }
 
 static void
@@ -1152,10 +1489,16 @@ pong_Fini(struct State *state)
 	// noop
 }
 
+static double
+pong_NextTick(struct State *state)
+{
+	return TICK_NOW;
+}
+
 static void
 pong_Preview(struct State *state, int x, int y, int size)
 {
-	struct Buffer *buf = &state->buffer;
+	struct Buffer *buf = state->buffer;
 	cairo_t *cr = buf->cr;
 	//struct Color bg = state->bg;
 	struct Color fg = state->fg;
@@ -1181,260 +1524,210 @@ pong_Preview(struct State *state, int x, int y, int size)
 	cairo_fill(cr);
 }
 
+_Static_assert((int)TPIECES_COUNT < (int)COLORS_COUNT, "every piece needs a color");
+
 static void
-tetris_CurPiecePoints(struct Tetris *tetris, struct Vec2 points[4])
+tetris_PiecePoints(enum TetrisPiece piece, enum Rotation rot, struct Vec2 pos,
+		struct Vec2 points[4])
 {
-	int y0 = tetris->curPos.y;
-	int x0 = tetris->curPos.x;
-
-	switch (tetris->curPiece) {
-	case TPIECE_STRAIGHT:
-		switch (tetris->rotation) {
-		case ROT_0: // fallthrough
-		case ROT_180:
-			for (int i = 0; i < 4; i++) {
-				points[i].x = x0;
-				points[i].y = y0 + i;
-			}
-			break;
-		case ROT_90: // fallthrough
-		case ROT_270:
-			for (int i = 0; i < 4; i++) {
-				points[i].x = x0 + i-2;
-				points[i].y = y0;
-			}
-			break;
-		default:
-			break;
-		}
-		break;
-	case TPIECE_SQUARE:
-		// rotation doesn't do anything
-		for (int dy = 0, i = 0; dy < 2; dy++) {
-			int y = y0 + dy;
-			for (int dx = 0; dx < 2; dx++) {
-				points[i].x = x0 + dx;
-				points[i].y = y;
-				i++;
-			}
-		}
-		break;
-	case TPIECE_T:
-		switch (tetris->rotation) {
-		case ROT_0:
-			for (int i = 0; i < 3; i++) {
-				points[i].x = x0 + i;
-				points[i].y = y0;
-			}
-			points[3].x = x0 + 1;
-			points[3].y = y0 + 1;
-			break;
-		case ROT_90:
-			for (int i = 0; i < 3; i++) {
-				points[i].x = x0;
-				points[i].y = y0+i;
-			}
-			points[3].x = x0 + 1;
-			points[3].y = y0 + 1;
-			break;
-		case ROT_180:
-			for (int i = 0; i < 3; i++) {
-				points[i].x = x0 + i;
-				points[i].y = y0+1;
-			}
-			points[3].x = x0 + 1;
-			points[3].y = y0;
-			break;
-		case ROT_270:
-			for (int i = 0; i < 3; i++) {
-				points[i].x = x0+1;
-				points[i].y = y0+i;
-			}
-			points[3].x = x0;
-			points[3].y = y0 + 1;
-			break;
-		default:
-			break;
-		}
-		break;
-	case TPIECE_L:
-		switch (tetris->rotation) {
-		case ROT_0:
-			points[0].x = x0;
-			points[0].y = y0;
-
-			points[1].x = x0;
-			points[1].y = y0 + 1;
-
-			points[2].x = x0;
-			points[2].y = y0 + 2;
-
-			points[3].x = x0 + 1;
-			points[3].y = y0 + 2;
-			break;
-		case ROT_90:
-			points[0].x = x0;
-			points[0].y = y0 + 1;
-
-			points[1].x = x0 + 1;
-			points[1].y = y0 + 1;
-
-			points[2].x = x0 + 2;
-			points[2].y = y0 + 1;
-
-			points[3].x = x0 + 2;
-			points[3].y = y0;
-			break;
-		case ROT_180:
-			points[0].x = x0+1;
-			points[0].y = y0;
-
-			points[1].x = x0+1;
-			points[1].y = y0 + 1;
-
-			points[2].x = x0+1;
-			points[2].y = y0 + 2;
+	const struct TetrisShape *shape = &tetris_shapes[piece][rot];
+	for (int i = 0; i < 4; i++) {
+		points[i].x = pos.x + shape->cells[i].x;
+		points[i].y = pos.y + shape->cells[i].y;
+	}
+}
 
-			points[3].x = x0;
-			points[3].y = y0;
-			break;
-		case ROT_270:
-			points[0].x = x0;
-			points[0].y = y0;
+static void
+tetris_CurPiecePoints(struct Tetris *tetris, struct Vec2 points[4])
+{
+	tetris_PiecePoints(tetris->curPiece, tetris->rotation, tetris->curPos, points);
+}
 
-			points[1].x = x0 + 1;
-			points[1].y = y0;
+static bool
+tetris_Occupied(struct Tetris *tetris, int x, int y)
+{
+	return tetris->rows[y] >> x & 1;
+}
 
-			points[2].x = x0 + 2;
-			points[2].y = y0;
+static void
+tetris_SetCell(struct Tetris *tetris, int x, int y, int color)
+{
+	tetris->board[y][x] = color;
+	if (color != 0)
+		tetris->rows[y] |= 1u << x;
+	else
+		tetris->rows[y] &= ~(1u << x);
+}
 
-			points[3].x = x0;
-			points[3].y = y0+1;
-			break;
-		default:
-			break;
+// Moves every row that isn't full down in one pass from the bottom, and
+// returns which rows were removed.
+static uint32_t
+tetris_RemoveFilledLines(struct Tetris *tetris)
+{
+	int length = TETRIS_WIDTH * sizeof(tetris->board[0][0]);
+	uint32_t cleared = 0;
+	int to = TETRIS_HEIGHT - 1;
+	for (int y = TETRIS_HEIGHT - 1; y >= 0; y--) {
+		if (tetris->rows[y] == TETRIS_FULL_ROW) {
+			cleared |= 1u << y;
+			continue;
 		}
-		break;
-	case TPIECE_SKEW:
-		switch (tetris->rotation) {
-		case ROT_0: // fallthrough
-		case ROT_180:
-			points[0].x = x0;
-			points[0].y = y0;
-
-			points[1].x = x0+1;
-			points[1].y = y0;
+		if (to != y) {
+			memcpy(tetris->board[to], tetris->board[y], length);
+			tetris->rows[to] = tetris->rows[y];
+		}
+		to--;
+	}
+	for (; to >= 0; to--) {
+		memset(tetris->board[to], 0, length);
+		tetris->rows[to] = 0;
+	}
+	return cleared;
+}
 
-			points[2].x = x0+1;
-			points[2].y = y0+1;
+static bool
+tetris_HasCollision(struct Tetris *tetris)
+{
+	return tetris_collides(tetris->rows, tetris->curPiece, tetris->rotation,
+			tetris->curPos.x, tetris->curPos.y);
+}
 
-			points[3].x = x0+2;
-			points[3].y = y0+1;
-			break;
-		case ROT_90: // fallthrough
-		case ROT_270:
-			y0 -= 1;
-			x0 += 1;
-			points[0].x = x0+1;
-			points[0].y = y0;
+// Pushes the falling piece back inside the side walls.
+static void
+tetris_ClampX(struct Tetris *tetris)
+{
+	const struct TetrisShape *shape = &tetris_shapes[tetris->curPiece][tetris->rotation];
+	int x = tetris->curPos.x + shape->left;
+	if (x < 0)
+		tetris->curPos.x -= x;
+	else if (x + shape->width > TETRIS_WIDTH)
+		tetris->curPos.x -= x + shape->width - TETRIS_WIDTH;
+}
 
-			points[1].x = x0;
-			points[1].y = y0+1;
+static bool
+tetris_Rotate(struct Tetris *tetris, enum Rotation rotation)
+{
+	if (!tetris_rotate(tetris->rows, tetris->curPiece, rotation,
+				&tetris->curPos.x, &tetris->curPos.y))
+		return false;
+	tetris->rotation = rotation;
+	return true;
+}
 
-			points[2].x = x0+1;
-			points[2].y = y0+1;
+// Queues the key the bot presses next to move the falling piece where it
+// wants it. It goes in with the player's keys, so the next frame takes it
+// and records it like any other, one key a frame.
+static void
+tetris_BotInput(struct State *state)
+{
+	struct Tetris *tetris = &state->tetris;
+	if (!tetris->autoplay || tetris->lost || state->input.keys_len > 0)
+		return;
 
-			points[3].x = x0;
-			points[3].y = y0+2;
-			break;
-		default:
-			break;
-		}
-		break;
-	default:
-		assert(0 && "unreachable");
-	}
+	if (tetris->planned != tetris->pieces) {
+		if (tetris->bot == NULL)
+			tetris->bot = tetris_bot_create(state->threads);
+		PROF_BEGIN(state, "tetris bot");
+		if (!tetris_bot_search(tetris->bot, tetris->rows, tetris->curPiece,
+					tetris->rotation, tetris->curPos.x, tetris->curPos.y,
+					tetris->nextPiece, &tetris->plan)) {
+			tetris->plan.rotation = tetris->rotation;
+			tetris->plan.x = tetris->curPos.x;
+		}
+		PROF_END(state);
+		tetris->planned = tetris->pieces;
+	}
+
+	xkb_keysym_t key = XKB_KEY_j;
+	if (tetris->rotation != tetris->plan.rotation)
+		key = XKB_KEY_z;
+	else if (tetris->curPos.x < tetris->plan.x)
+		key = XKB_KEY_l;
+	else if (tetris->curPos.x > tetris->plan.x)
+		key = XKB_KEY_h;
+	input_append(&state->input, &(struct InputEvent){
+		.keysym = key,
+		.state = KEY_PRESSED,
+	});
 }
 
+// Starts a new game, the bot and autoplay are kept.
 static void
-tetris_RemoveFilledLines(struct Tetris *tetris)
+tetris_Reset(struct State *state)
 {
-	for (int y = 0; y < TETRIS_HEIGHT; y++) {
-		int n = 0;
-		for (int x = 0; x < TETRIS_WIDTH; x++) {
-			n += tetris->board[y][x] > 0;
-		}
-		if (n == TETRIS_WIDTH) {
-			int y0 = y;
-			int length = TETRIS_WIDTH * sizeof(tetris->board[0][0]);
-			for (int i = y0; i > 0; i--) {
-				memmove(tetris->board[i], tetris->board[i-1], length);
-			}
-			memset(tetris->board[0], 0, length);
-		}
-	}
+	struct Tetris *tetris = &state->tetris;
+	struct TetrisBot *bot = tetris->bot;
+	bool autoplay = tetris->autoplay;
+
+	memset(tetris, 0, sizeof(*tetris));
+	tetris->bot = bot;
+	tetris->autoplay = autoplay;
+	tetris->planned = -1;
+	tetris->rng = rng_split(&state->rng);
+	tetris->nextPiece    = rng_range(&tetris->rng, TPIECES_COUNT);
+	tetris->curPiece     = rng_range(&tetris->rng, TPIECES_COUNT);
+	tetris->nextRotation = rng_range(&tetris->rng, ROTS_COUNT);
+	tetris->rotation     = rng_range(&tetris->rng, ROTS_COUNT);
+	state->tetris.curPos = (struct Vec2){
+		.x = rng_range(&tetris->rng, TETRIS_WIDTH),
+		.y = 0,
+	};
+
+	tetris_ClampX(tetris);
 }
 
-static bool
-tetris_HasCollision(struct Tetris *tetris)
+// Moves the falling piece a column if it fits.
+static void
+tetris_Move(struct State *state, int dx)
 {
-	struct Vec2 points[4];
-	tetris_CurPiecePoints(tetris, points);
-	for (int i = 0; i < 4; i++) {
-		if (points[i].y < 0)
-			continue;
-		if (points[i].x < 0 ||
-				points[i].x >= TETRIS_WIDTH ||
-				points[i].y >= TETRIS_HEIGHT ||
-				tetris->board[points[i].y][points[i].x] != 0) {
-			return true;
-		}
-	}
-	return false;
+	struct Tetris *tetris = &state->tetris;
+	if (tetris->lost)
+		return;
+	tetris->curPos.x += dx;
+	if (tetris_HasCollision(tetris))
+		tetris->curPos.x -= dx;
+
+	state->redraw = true;
 }
 
-static void
-tetris_Update(struct State *state, struct Input input, double dt)
+// Every key is applied on its own, so repeats that pile up in one update
+// all move the piece. Returns true if the board itself changed, not just
+// the falling piece.
+static bool
+tetris_Step(struct State *state, const struct Input *input)
 {
 	struct Tetris *tetris = &state->tetris;
-	int dx = 0;
 	bool down = false;
-	for (size_t i = 0; i < input.keys_len; i++) {
-		if (input.keys[i].state == KEY_RELEASED) {
+	for (size_t i = 0; i < input->keys_len; i++) {
+		xkb_keysym_t keysym = input->keys[i].keysym;
+		enum KeyState keyState = input->keys[i].state;
+		if (keyState == KEY_RELEASED) {
 			continue;
 		}
-		int saved_rotation = tetris->rotation;
-		switch (input.keys[i].keysym) {
+		switch (keysym) {
 		case XKB_KEY_x:
-			tetris->rotation -= 1;
-			if (tetris->rotation < 0)
-				tetris->rotation = ROTS_COUNT - 1;
-
-			if (tetris_HasCollision(tetris)) {
-				tetris->rotation = saved_rotation;
-			} else {
+			if (tetris_Rotate(tetris, (tetris->rotation + ROTS_COUNT - 1) % ROTS_COUNT))
 				state->redraw = true;
-			}
 			break;
 		case XKB_KEY_z:
-			tetris->rotation = (tetris->rotation + 1) % ROTS_COUNT;
-			if (tetris_HasCollision(tetris)) {
-				tetris->rotation = saved_rotation;
-			} else {
+			if (tetris_Rotate(tetris, (tetris->rotation + 1) % ROTS_COUNT))
 				state->redraw = true;
-			}
 			break;
 		case XKB_KEY_r:
-			tetris_Init(state);
-			tetris->lost = false;
-			return;
+			tetris_Reset(state);
+			state->redraw = true;
+			return true;
+		case XKB_KEY_a:
+			if (keyState == KEY_PRESSED)
+				tetris->autoplay = !tetris->autoplay;
+			break;
 		case XKB_KEY_Left: // fallthrough
 		case XKB_KEY_h:
-			dx = -1;
+			tetris_Move(state, -1);
 			break;
 		case XKB_KEY_Right: // fallthrough
 		case XKB_KEY_l:
-			dx = +1;
+			tetris_Move(state, +1);
 			break;
 		case XKB_KEY_Down: // fallthrough
 		case XKB_KEY_j:
@@ -1443,45 +1736,17 @@ tetris_Update(struct State *state, struct Input input, double dt)
 		}
 	}
 	if (tetris->lost)
-		return;
-
-	if (dx != 0) {
-		int saved_x = tetris->curPos.x;
-		tetris->curPos.x += dx;
-		struct Vec2 points[4];
-		tetris_CurPiecePoints(tetris, points);
-		int dx = 0;
-		for (int i = 0; i < 4; i++) {
-			if (points[i].x >= TETRIS_WIDTH) {
-				int new_dx = TETRIS_WIDTH - points[i].x - 1;
-				if (new_dx < dx) {
-					dx = new_dx;
-				}
-			} else if (points[i].x < 0) {
-				int new_dx = -points[i].x;
-				if (new_dx > dx) {
-					dx = new_dx;
-				}
-			} else if (points[i].y >= 0 && tetris->board[points[i].y][points[i].x] != 0) {
-				dx = saved_x - tetris->curPos.x;
-				break;
-			}
-		}
-		tetris->curPos.x += dx;
-
-		state->redraw = true;
-	}
+		return false;
 
-	static double accumTime = 0;
-	accumTime += dt;
+	tetris->accum_time += TICK_DT;
 
-	double timeInterval = 0.7;
+	double timeInterval = TETRIS_FALL_INTERVAL;
 	if (down) {
 		timeInterval = 0.05;
 	}
 
-	if (accumTime > timeInterval) {
-		accumTime = 0;
+	if (tetris->accum_time > timeInterval) {
+		tetris->accum_time = 0;
 		state->redraw = true;
 
 		tetris->curPos.y += 1;
@@ -1494,58 +1759,110 @@ tetris_Update(struct State *state, struct Input input, double dt)
 			if (points[i].y < 0 )
 				continue;
 			if (points[i].y == TETRIS_HEIGHT ||
-					tetris->board[points[i].y][points[i].x] != 0) {
+					tetris_Occupied(tetris, points[i].x, points[i].y)) {
+				tetris->dirty_rows = 0;
 				for (int i = 0; i < 4; i++) {
 					if (points[i].y > 0) {
-						tetris->board[points[i].y-1][points[i].x] = color;
+						tetris_SetCell(tetris, points[i].x, points[i].y-1, color);
+						if (points[i].y > tetris->dirty_rows)
+							tetris->dirty_rows = points[i].y;
 					}
 				}
-				tetris_RemoveFilledLines(tetris);
+				tetris->cleared = tetris_RemoveFilledLines(tetris);
+				if (tetris->cleared) {
+					int lowest = 32 - __builtin_clz(tetris->cleared);
+					if (lowest > tetris->dirty_rows)
+						tetris->dirty_rows = lowest;
+				}
 
 				tetris->curPiece = tetris->nextPiece;
 				tetris->rotation = tetris->nextRotation;
-				tetris->nextPiece = rand() % TPIECES_COUNT;
-				tetris->nextRotation = rand() % ROTS_COUNT;
+				tetris->nextPiece = rng_range(&tetris->rng, TPIECES_COUNT);
+				tetris->nextRotation = rng_range(&tetris->rng, ROTS_COUNT);
 
 				tetris->curPos = (struct Vec2){
-					.x = rand() % TETRIS_WIDTH,
+					.x = rng_range(&tetris->rng, TETRIS_WIDTH),
 					.y = 0,
 				};
-				tetris_CurPiecePoints(tetris, points);
-				int dx = 0;
-				for (int i = 0; i < 4; i++) {
-					if (points[i].x >= TETRIS_WIDTH) {
-						int new_dx = TETRIS_WIDTH - points[i].x - 1;
-						if (new_dx < dx) {
-							dx = new_dx;
-						}
-					} else if (points[i].x < 0) {
-						int new_dx = -points[i].x;
-						if (new_dx > dx) {
-							dx = new_dx;
-						}
-					} else if (points[i].y < 0) {
-						continue;
-					} else if (tetris->board[points[i].y][points[i].x] > 0) {
-						tetris->lost = true;
-						return;
-					}
-				}
-				tetris->curPos.x += dx;
-				return;
+				tetris->pieces++;
+				tetris_ClampX(tetris);
+				if (tetris_HasCollision(tetris))
+					tetris->lost = true;
+				return true;
 			}
 		}
 	}
+	return false;
+}
+
+#define TETRIS_INFO_WIDTH 4 // blocks
+#define TETRIS_INFO_PADDING 5 // pixels
+
+// Where the board goes in the buffer, the info bar is to the right of it.
+static void
+tetris_Layout(struct State *state, int *xoff, int *yoff, float *scale)
+{
+	struct Buffer *buf = state->buffer;
+	scaleAndCenterRect(buf->width - TETRIS_INFO_PADDING, buf->height,
+			TETRIS_WIDTH + TETRIS_INFO_WIDTH, TETRIS_HEIGHT,
+			xoff, yoff, scale);
+}
+
+static void
+tetris_Update(struct State *state, const struct Input *input)
+{
+	struct Tetris *tetris = &state->tetris;
+
+	struct Vec2 prevPoints[4];
+	tetris_CurPiecePoints(tetris, prevPoints);
+
+	bool fullRedraw = damagedAll(state);
+	PROF_BEGIN(state, "tetris update");
+	tetris->dirty_rows = 0;
+	bool changed = tetris_Step(state, input);
+	PROF_END(state);
+	tetris_BotInput(state);
+
+	// Unless something landed only the falling piece moved. Landing changes
+	// the rows above the lowest one touched, and the next piece, a restart
+	// leaves dirty_rows at 0.
+	if (changed && (tetris->lost || tetris->dirty_rows == 0)) {
+		damageAll(state);
+		return;
+	}
+	if (tetris->lost || fullRedraw || !state->redraw)
+		return;
+
+	int xoff = 0, yoff = 0;
+	float scale = 1;
+	tetris_Layout(state, &xoff, &yoff, &scale);
+	if (changed) {
+		addDamageF(state, (struct FRect){0, 0, TETRIS_WIDTH, tetris->dirty_rows},
+				xoff, yoff, scale);
+		addDamageF(state, (struct FRect){TETRIS_WIDTH, 0,
+				TETRIS_INFO_WIDTH + (double)TETRIS_INFO_PADDING / scale,
+				TETRIS_HEIGHT}, xoff, yoff, scale);
+	}
+	struct Vec2 points[4];
+	tetris_CurPiecePoints(tetris, points);
+	for (int i = 0; i < 4; i++) {
+		addDamageF(state, (struct FRect){prevPoints[i].x, prevPoints[i].y, 1, 1},
+				xoff, yoff, scale);
+		addDamageF(state, (struct FRect){points[i].x, points[i].y, 1, 1},
+				xoff, yoff, scale);
+	}
 }
 
 static void
-tetris_UpdateDraw(struct State *state, struct Input input, double dt)
+tetris_Draw(struct State *state, double alpha)
 {
 	struct Tetris *tetris = &state->tetris;
+	if (!state->redraw)
+		return;
 
-	tetris_Update(state, input, dt);
+	PROF_BEGIN(state, "tetris draw");
 
-	struct Buffer *buf = &state->buffer;
+	struct Buffer *buf = state->buffer;
 	cairo_t *cr = buf->cr;
 	struct Color bg = state->bg;
 	struct Color fg = state->fg;
@@ -1559,12 +1876,10 @@ tetris_UpdateDraw(struct State *state, struct Input input, double dt)
 	int height = TETRIS_HEIGHT;
 	float scale = 1;
 
-	int info_width_blk = 4; // "blocks"
-	int info_padding = 5;  // pixels
+	int info_width_blk = TETRIS_INFO_WIDTH;
+	int info_padding = TETRIS_INFO_PADDING;
 
-	scaleAndCenterRect(buf->width - info_padding, buf->height,
-			width + info_width_blk, height,
-			&xoff, &yoff, &scale);
+	tetris_Layout(state, &xoff, &yoff, &scale);
 
 	int info_width = info_width_blk * scale;
 
@@ -1583,39 +1898,13 @@ tetris_UpdateDraw(struct State *state, struct Input input, double dt)
 		cairo_rectangle(cr, start_x, start_y, w, h);
 		cairo_fill(cr);
 
-		enum TetrisPiece saved_piece = tetris->curPiece;
-		enum Rotation saved_rot = tetris->rotation;
-		struct Vec2 saved_pos = tetris->curPos;
-
-		tetris->curPiece = tetris->nextPiece;
-		tetris->rotation = tetris->nextRotation;
-		tetris->curPos.x = 0;
-		tetris->curPos.y = 0;
-
-		struct Vec2 points[4];
-		tetris_CurPiecePoints(tetris, points);
-		int color = (tetris->curPiece + 1) % COLORS_COUNT;
-
-		tetris->curPiece = saved_piece;
-		tetris->rotation = saved_rot;
-		tetris->curPos   = saved_pos;
+		const struct TetrisShape *shape =
+			&tetris_shapes[tetris->nextPiece][tetris->nextRotation];
+		int color = (tetris->nextPiece + 1) % COLORS_COUNT;
 
 		int board[4][4] = {0};
-		int min_y = 0;
-		int min_x = 0;
-		for (int i = 0; i < 4; i++) {
-			if (points[i].x < min_x) {
-				min_x = points[i].x;
-			}
-			if (points[i].y < min_y) {
-				min_y = points[i].y;
-			}
-		}
-
-		min_x = -min_x;
-		min_y = -min_y;
 		for (int i = 0; i < 4; i++) {
-			board[points[i].y + min_y][points[i].x + min_x] = color;
+			board[shape->cells[i].y - shape->top][shape->cells[i].x - shape->left] = color;
 		}
 
 		double sz = ceil((double)w / 6.0); // 4 + 2 padding
@@ -1633,6 +1922,17 @@ tetris_UpdateDraw(struct State *state, struct Input input, double dt)
 				cairo_fill(cr);
 			}
 		}
+
+		struct TetrisBot *bot = tetris->bot;
+		if (tetris->autoplay && bot != NULL && bot->elapsed > 0) {
+			char text[64];
+			snprintf(text, sizeof(text), "bot %.2fM/s",
+					bot->evaluated / bot->elapsed / 1e6);
+			cairo_set_source_rgba(cr, COLOR_CAIRO(fg));
+			cairo_set_font_size(cr, sz * 0.6);
+			cairo_move_to(cr, start_x + sz, start_y + 7 * sz);
+			cairo_show_text(cr, text);
+		}
 	}
 
 	double sz = ceil(scale);
@@ -1682,52 +1982,52 @@ tetris_UpdateDraw(struct State *state, struct Input input, double dt)
 		cairo_move_to(cr, tx, ty);
 		cairo_show_text(cr, text);
 	}
+
+	PROF_END(state);
 }
 
 static void
 tetris_Init(struct State *state)
 {
 	struct Tetris *tetris = &state->tetris;
-	struct Vec2 points[4];
-	int dx = 0;
-
 	memset(tetris, 0, sizeof(*tetris));
-	tetris->nextPiece    = rand() % TPIECES_COUNT;
-	tetris->curPiece     = rand() % TPIECES_COUNT;
-	tetris->nextRotation = rand() % ROTS_COUNT;
-	tetris->rotation     = rand() % ROTS_COUNT;
-	state->tetris.curPos = (struct Vec2){
-		.x = rand() % TETRIS_WIDTH,
-		.y = 0,
-	};
-
-	tetris_CurPiecePoints(tetris, points);
-	for (int i = 0; i < 4; i++) {
-		if (points[i].x >= TETRIS_WIDTH) {
-			int new_dx = TETRIS_WIDTH - points[i].x - 1;
-			if (new_dx < dx) {
-				dx = new_dx;
-			}
-		} else if (points[i].x < 0) {
-			int new_dx = -points[i].x;
-			if (new_dx > dx) {
-				dx = new_dx;
-			}
-		}
-	}
-	tetris->curPos.x += dx;
+	tetris->autoplay = state->autoplay;
+	tetris_Reset(state);
 }
 
 static void
 tetris_Fini(struct State *state)
 {
-	// noop
+	struct TetrisBot *bot = state->tetris.bot;
+	if (bot == NULL)
+		return;
+	if (bot->elapsed > 0) {
+		fprintf(stderr, "tetris bot: %llu placements in %.3fs, %.0f/s\n",
+				(unsigned long long)bot->evaluated, bot->elapsed,
+				bot->evaluated / bot->elapsed);
+	}
+	tetris_bot_destroy(bot);
+	state->tetris.bot = NULL;
+}
+
+static double
+tetris_NextTick(struct State *state)
+{
+	struct Tetris *tetris = &state->tetris;
+	if (tetris->lost)
+		return TICK_IDLE;
+	// the bot presses a key every frame.
+	if (tetris->autoplay)
+		return TICK_NOW;
+	if (tetris->accum_time > TETRIS_FALL_INTERVAL)
+		return TICK_NOW;
+	return TETRIS_FALL_INTERVAL - tetris->accum_time + 0.001;
 }
 
 static void
 tetris_Preview(struct State *state, int x, int y, int size)
 {
-	struct Buffer *buf = &state->buffer;
+	struct Buffer *buf = state->buffer;
 	cairo_t *cr = buf->cr;
 	struct Color fg = state->fg;
 	double blockSize = size * 0.1;
@@ -1753,8 +2053,9 @@ tetris_Preview(struct State *state, int x, int y, int size)
 	cairo_fill(cr);
 }
 
+// Returns true if the car moved or turned.
 static bool
-car_race_Update(struct State *state, struct Input input, double dt)
+car_race_Step(struct State *state, const struct Input *input)
 {
 	struct CarRace *car = &state->car;
 	enum {
@@ -1770,11 +2071,11 @@ car_race_Update(struct State *state, struct Input input, double dt)
 
 #define CAR_VELOCITY 2.0
 #define CAR_TURN_ANGLE 0.05
-	for (size_t i = 0; i < input.keys_len; i++) {
-		bool b = input.keys[i].state != KEY_RELEASED;
-		switch (input.keys[i].keysym) {
+	for (size_t i = 0; i < input->keys_len; i++) {
+		bool b = input->keys[i].state != KEY_RELEASED;
+		switch (input->keys[i].keysym) {
 		case XKB_KEY_p:
-			if (input.keys[i].state == KEY_PRESSED)
+			if (input->keys[i].state == KEY_PRESSED)
 				pause = !pause;
 			break;
 		case XKB_KEY_k:
@@ -1821,8 +2122,8 @@ car_race_Update(struct State *state, struct Input input, double dt)
 
 	struct FVec2 p = rotate(CAR_LENGTH, 0, car->angle);
 
-	car->carPos.x += p.x * car->velocity * dt;
-	car->carPos.y += p.y * car->velocity * dt;
+	car->carPos.x += p.x * car->velocity * TICK_DT;
+	car->carPos.y += p.y * car->velocity * TICK_DT;
 	car->velocity += car->accel * 0.9;
 	car->velocity *= 0.9;
 
@@ -1880,18 +2181,35 @@ car_race_Update(struct State *state, struct Input input, double dt)
 }
 
 static void
-car_race_UpdateDraw(struct State *state, struct Input input, double dt)
+car_race_Update(struct State *state, const struct Input *input)
+{
+	struct CarRace *car = &state->car;
+	car->prevPos = car->carPos;
+	car->prevAngle = car->angle;
+
+	PROF_BEGIN(state, "car_race update");
+	if (car_race_Step(state, input))
+		state->redraw = true;
+	PROF_END(state);
+}
+
+static void
+car_race_Draw(struct State *state, double alpha)
 {
-	struct Buffer *buf = &state->buffer;
+	struct Buffer *buf = state->buffer;
 	cairo_t *cr = buf->cr;
 	struct Color bg = state->bg;
 	struct Color fg = state->fg;
 	struct CarRace *car = &state->car;
 
-	bool redraw = car_race_Update(state, input, dt);
-	if (!state->redraw && !redraw)
+	// still moving towards where the last update put it.
+	if (car->prevPos.x != car->carPos.x || car->prevPos.y != car->carPos.y ||
+			car->prevAngle != car->angle)
+		state->redraw = true;
+	if (!state->redraw)
 		return;
-	state->redraw = true;
+
+	PROF_BEGIN(state, "car_race draw");
 
 	cairo_set_source_rgba(cr, COLOR_CAIRO(bg));
 	cairo_paint(cr);
@@ -1940,11 +2258,15 @@ car_race_UpdateDraw(struct State *state, struct Input input, double dt)
 		cairo_stroke(cr);
 	}
 
-	struct FVec2 p = rotate(CAR_LENGTH, 0, car->angle);
-	p.x += car->carPos.x;
-	p.y += car->carPos.y;
-	double x1 = xoff + car->carPos.x*scale;
-	double y1 = yoff + car->carPos.y*scale;
+	struct FVec2 pos = {
+		lerpf(car->prevPos.x, car->carPos.x, alpha),
+		lerpf(car->prevPos.y, car->carPos.y, alpha),
+	};
+	struct FVec2 p = rotate(CAR_LENGTH, 0, lerpf(car->prevAngle, car->angle, alpha));
+	p.x += pos.x;
+	p.y += pos.y;
+	double x1 = xoff + pos.x*scale;
+	double y1 = yoff + pos.y*scale;
 	double x2 = xoff + p.x*scale;
 	double y2 = yoff + p.y*scale;
 
@@ -1973,6 +2295,7 @@ car_race_UpdateDraw(struct State *state, struct Input input, double dt)
 		cairo_move_to(cr, tx, ty);
 		cairo_show_text(cr, text);
 	}
+	PROF_END(state);
 }
 
 static void
@@ -2030,6 +2353,8 @@ car_race_Init(struct State *state)
 				0.5);
 	car->carPos.y = car->startingLine.points[0].y + CAR_LENGTH + 1;
 	car->angle = 3 * PI / 2;
+	car->prevPos = car->carPos;
+	car->prevAngle = car->angle;
 
 	// XXX: this is kind of stupid, but it works
 	static cairo_surface_t *surf = NULL;
@@ -2061,10 +2386,16 @@ car_race_Fini(struct State *state)
 	// noop
 }
 
+static double
+car_race_NextTick(struct State *state)
+{
+	return TICK_NOW;
+}
+
 static void
 car_race_Preview(struct State *state, int x, int y, int size)
 {
-	struct Buffer *buf = &state->buffer;
+	struct Buffer *buf = state->buffer;
 	cairo_t *cr = buf->cr;
 	//struct Color bg = state->bg;
 	struct Color fg = state->fg;
@@ -2111,14 +2442,12 @@ car_race_Preview(struct State *state, int x, int y, int size)
 	cairo_fill(cr);
 }
 
+// Speeds are in units per update.
 static void
-breakout_UpdateDraw(struct State *state, struct Input input, double dt)
+breakout_Update(struct State *state, const struct Input *input)
 {
 	struct Breakout *br = &state->breakout;
-	struct Buffer *buf = &state->buffer;
-	struct Color fg = state->fg;
-	struct Color bg = state->bg;
-	cairo_t *cr = buf->cr;
+	struct Buffer *buf = state->buffer;
 
 	int xoff = 0, yoff = 0;
 	float scale = 0;
@@ -2126,18 +2455,21 @@ breakout_UpdateDraw(struct State *state, struct Input input, double dt)
 			BREAKOUT_WIDTH, BREAKOUT_HEIGHT,
 			&xoff, &yoff, &scale);
 
+	br->prev.ball_pos = br->ball_pos;
+	br->prev.x_pos = br->x_pos;
+
 	static bool left = false;
 	static bool right = false;
-	for (size_t i = 0; i < input.keys_len; i++) {
-		switch (input.keys[i].keysym) {
+	for (size_t i = 0; i < input->keys_len; i++) {
+		switch (input->keys[i].keysym) {
 		case XKB_KEY_h:
-			left = input.keys[i].state != KEY_RELEASED;
+			left = input->keys[i].state != KEY_RELEASED;
 			break;
 		case XKB_KEY_l:
-			right = input.keys[i].state != KEY_RELEASED;
+			right = input->keys[i].state != KEY_RELEASED;
 			break;
 		case XKB_KEY_space:
-			if (!br->move_ball && input.keys[i].state == KEY_PRESSED) {
+			if (!br->move_ball && input->keys[i].state == KEY_PRESSED) {
 				br->ball_speed = BREAKOUT_BALL_SPEED;
 				br->ball_velocity.x = BREAKOUT_BALL_SPEED/2;
 				br->ball_velocity.y = -BREAKOUT_BALL_SPEED;
@@ -2147,6 +2479,7 @@ breakout_UpdateDraw(struct State *state, struct Input input, double dt)
 		}
 	}
 
+	PROF_BEGIN(state, "breakout update");
 	if (left)
 		br->x_pos -= BREAKOUT_PLAYER_SPEED;
 
@@ -2231,6 +2564,7 @@ breakout_UpdateDraw(struct State *state, struct Input input, double dt)
 
 				if (hasIntersectionF(bar, ball)) {
 					br->bars_destroyed[y][x] = true;
+					addDamageF(state, bar, xoff, yoff, scale);
 					if (ball.x <= bar.x &&
 							bar.x <= ball.x + ball.w) {
 						br->ball_velocity.x *= -1;
@@ -2253,7 +2587,31 @@ breakout_UpdateDraw(struct State *state, struct Input input, double dt)
 		br->ball_pos.y = BREAKOUT_PLAYER_Y - BREAKOUT_BALL_RADIUS;
 	}
 
+	PROF_END(state);
+}
+
+static void
+breakout_Draw(struct State *state, double alpha)
+{
+	struct Breakout *br = &state->breakout;
+	struct Buffer *buf = state->buffer;
+	struct Color fg = state->fg;
+	struct Color bg = state->bg;
+	cairo_t *cr = buf->cr;
+
+	int xoff = 0, yoff = 0;
+	float scale = 0;
+	scaleAndCenterRect(buf->width, buf->height,
+			BREAKOUT_WIDTH, BREAKOUT_HEIGHT,
+			&xoff, &yoff, &scale);
+
+	PROF_BEGIN(state, "breakout draw");
 	state->redraw = true;
+	struct FVec2 ball = {
+		lerpf(br->prev.ball_pos.x, br->ball_pos.x, alpha),
+		lerpf(br->prev.ball_pos.y, br->ball_pos.y, alpha),
+	};
+	float x_pos = lerpf(br->prev.x_pos, br->x_pos, alpha);
 	cairo_set_source_rgba(cr, lerpf(bg.r, fg.r, 0.1),
 			lerpf(bg.g, fg.g, 0.1), lerpf(bg.b, fg.b, 0.1),
 			bg.a);
@@ -2286,16 +2644,33 @@ breakout_UpdateDraw(struct State *state, struct Input input, double dt)
 	cairo_set_source_rgba(cr, COLOR_CAIRO(fg));
 
 	cairo_arc(cr,
-			xoff + scale * br->ball_pos.x,
-			yoff + scale * br->ball_pos.y,
+			xoff + scale * ball.x,
+			yoff + scale * ball.y,
 			scale * BREAKOUT_BALL_RADIUS, 0, PI * 2);
 
 	cairo_rectangle(cr,
-			xoff + scale * br->x_pos,
+			xoff + scale * x_pos,
 			yoff + scale * BREAKOUT_PLAYER_Y,
 			scale * BREAKOUT_PLAYER_WIDTH,
 			scale * BREAKOUT_PLAYER_HEIGHT);
 	cairo_fill(cr);
+
+	float r = BREAKOUT_BALL_RADIUS;
+	struct FVec2 prevBall = br->drawn.ball_pos;
+	float prevX = br->drawn.x_pos;
+	addDamageF(state, (struct FRect){prevBall.x - r, prevBall.y - r, r*2, r*2},
+			xoff, yoff, scale);
+	addDamageF(state, (struct FRect){ball.x - r, ball.y - r, r*2, r*2},
+			xoff, yoff, scale);
+	addDamageF(state, (struct FRect){
+				fminf(prevX, x_pos),
+				BREAKOUT_PLAYER_Y,
+				fabsf(prevX - x_pos) + BREAKOUT_PLAYER_WIDTH,
+				BREAKOUT_PLAYER_HEIGHT,
+			}, xoff, yoff, scale);
+	br->drawn.ball_pos = ball;
+	br->drawn.x_pos = x_pos;
+	PROF_END(state);
 }
 
 static void
@@ -2305,6 +2680,11 @@ breakout_Init(struct State *state)
 	memset(br, 0, sizeof(*br));
 
 	br->x_pos = BREAKOUT_WIDTH/2 - BREAKOUT_PLAYER_WIDTH/2;
+	br->ball_pos.x = br->x_pos + BREAKOUT_PLAYER_WIDTH/2;
+	br->ball_pos.y = BREAKOUT_PLAYER_Y - BREAKOUT_BALL_RADIUS;
+	br->prev.x_pos = br->x_pos;
+	br->prev.ball_pos = br->ball_pos;
+	br->drawn = br->prev;
 }
 
 static void
@@ -2313,10 +2693,16 @@ breakout_Fini(struct State *state)
 	// noop
 }
 
+static double
+breakout_NextTick(struct State *state)
+{
+	return TICK_NOW;
+}
+
 static void
 breakout_Preview(struct State *state, int x, int y, int size)
 {
-	struct Buffer *buf = &state->buffer;
+	struct Buffer *buf = state->buffer;
 	cairo_t *cr = buf->cr;
 	struct Color fg = state->fg;
 	double paddleSize = size * 0.05;
@@ -2351,7 +2737,7 @@ breakout_Preview(struct State *state, int x, int y, int size)
 static void
 selectDraw(struct State *state)
 {
-	struct Buffer *buf = &state->buffer;
+	struct Buffer *buf = state->buffer;
 	cairo_t *cr = buf->cr;
 
 	struct Color bg = state->bg;
@@ -2509,11 +2895,11 @@ selectHandleKey(struct State *state, xkb_keysym_t key)
 }
 
 void
-selectUpdateDraw(struct State *state, struct Input input, double dt)
+selectUpdateDraw(struct State *state, const struct Input *input, double dt)
 {
-	for (size_t i = 0; i < input.keys_len; i++) {
-		if (input.keys[i].state == KEY_PRESSED) {
-			selectHandleKey(state, input.keys[i].keysym);
+	for (size_t i = 0; i < input->keys_len; i++) {
+		if (input->keys[i].state == KEY_PRESSED) {
+			selectHandleKey(state, input->keys[i].keysym);
 		}
 	}
 
@@ -2530,5 +2916,7 @@ selectUpdateDraw(struct State *state, struct Input input, double dt)
 		games[state->cur_game].init(state);
 		state->redraw = true;
 	}
+	PROF_BEGIN(state, "select draw");
 	selectDraw(state);
+	PROF_END(state);
 }
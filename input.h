@@ -0,0 +1,123 @@
+/*
+ * Key events on their way from the thread that reads them to the render
+ * thread, which hands them to the games.
+ *
+ * The ring has a single producer and a single consumer and needs no lock,
+ * each side only writes its own index. Everything is static inline so
+ * main.c and games.c (which may be a separately loaded libgames.so) agree
+ * on the layout.
+ */
+
+#ifndef INPUT_H
+#define INPUT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <xkbcommon/xkbcommon.h>
+
+#define MAX_INPUT_KEYS 256
+#define INPUT_RING_SIZE 256
+_Static_assert((INPUT_RING_SIZE & (INPUT_RING_SIZE - 1)) == 0,
+		"INPUT_RING_SIZE must be a power of two");
+
+enum KeyState {
+	KEY_PRESSED,
+	KEY_REPEAT,
+	KEY_RELEASED,
+};
+
+struct InputEvent {
+	xkb_keysym_t keysym;
+	enum KeyState state;
+	// CLOCK_MONOTONIC seconds, when the key was pressed, released or
+	// repeated. Replays don't keep it.
+	double time;
+	// The compositor's timestamp in milliseconds, its base is undefined
+	// but it's the clock frame callbacks use too. Zero if unknown.
+	uint32_t msec;
+};
+
+// The keys an update gets, oldest first. Games only ever see it through a
+// const pointer, but may queue keys of their own in state->input for the
+// next frame.
+struct Input {
+	struct InputEvent keys[MAX_INPUT_KEYS];
+	size_t keys_len;
+};
+
+// Adds ev after the keys already there, returns false if in is full.
+static inline bool
+input_append(struct Input *in, const struct InputEvent *ev)
+{
+	if (in->keys_len == MAX_INPUT_KEYS)
+		return false;
+	in->keys[in->keys_len++] = *ev;
+	return true;
+}
+
+// Moves the keys of src to dst and leaves src empty.
+static inline void
+input_take(struct Input *dst, struct Input *src)
+{
+	memcpy(dst->keys, src->keys, src->keys_len * sizeof(src->keys[0]));
+	dst->keys_len = src->keys_len;
+	src->keys_len = 0;
+}
+
+struct InputRing {
+	struct InputEvent events[INPUT_RING_SIZE];
+	// Both only count up and are taken modulo INPUT_RING_SIZE, head is
+	// written by the producer and tail by the consumer.
+	_Atomic size_t head;
+	_Atomic size_t tail;
+	// events that didn't fit, only touched by the producer.
+	int dropped;
+};
+
+// Producer side, returns false and counts the event as dropped if the ring
+// is full.
+static inline bool
+input_ring_push(struct InputRing *r, const struct InputEvent *ev)
+{
+	size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+	if (head - tail == INPUT_RING_SIZE) {
+		r->dropped++;
+		return false;
+	}
+	r->events[head % INPUT_RING_SIZE] = *ev;
+	atomic_store_explicit(&r->head, head + 1, memory_order_release);
+	return true;
+}
+
+// Consumer side, the oldest event or NULL if there is none. It stays in
+// the ring until input_ring_pop.
+static inline const struct InputEvent *
+input_ring_peek(struct InputRing *r)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	size_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	if (head == tail)
+		return NULL;
+	return &r->events[tail % INPUT_RING_SIZE];
+}
+
+static inline void
+input_ring_pop(struct InputRing *r)
+{
+	size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+}
+
+// Safe to call from either side.
+static inline bool
+input_ring_empty(struct InputRing *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire) ==
+		atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+#endif
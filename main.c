@@ -2,14 +2,20 @@
 #include <cairo.h>
 #include <dlfcn.h>
 #include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
-#include <sys/select.h>
+#include <sys/signalfd.h>
 #include <sys/timerfd.h>
+#include <time.h>
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wayland-cursor.h>
@@ -18,8 +24,17 @@
 #include "xdg-decoration-unstable-client-protocol.h"
 #include "xdg-shell-client-protocol.h"
 #include "shm.h"
+#include "input.h"
+#include "prof.h"
+#include "replay.h"
+#include "rng.h"
+#include "sudoku.h"
+#include "tetris.h"
 #include "main.h"
 
+_Static_assert(MAX_BUFFERS <= SHM_POOL_MAX_ALLOCS, "shm pool too small for the swap chain");
+_Static_assert(MAX_INPUT_KEYS <= REPLAY_MAX_KEYS, "replay frames can't hold struct Input");
+
 #define XRES_NO_LOG
 #define XRES_IMPLEMENTATION
 #include "rgb.h"
@@ -28,13 +43,48 @@
 #if HOTRELOAD
 static struct GameInterface *games;
 static size_t games_len;
-void (*selectUpdateDraw)(struct State *state, struct Input input, double dt);
+void (*selectUpdateDraw)(struct State *state, const struct Input *input, double dt);
 #else
 extern struct GameInterface games[];
 extern size_t games_len;
-void selectUpdateDraw(struct State *state, struct Input input, double dt);
+void selectUpdateDraw(struct State *state, const struct Input *input, double dt);
 #endif
 
+static void *
+erealloc(void *ptr, size_t size)
+{
+	void *p = realloc(ptr, size);
+	if (p == NULL) {
+		perror("realloc: ");
+		exit(1);
+	}
+
+	return p;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Reads the count out of a timerfd or eventfd, 0 if it hasn't fired.
+static uint64_t
+readCounter(int fd, const char *what)
+{
+	uint64_t count = 0;
+	if (read(fd, &count, sizeof(count)) < 0) {
+		if (errno != EAGAIN) {
+			perror(what);
+			exit(1);
+		}
+		return 0;
+	}
+	return count;
+}
+
 #if HOTRELOAD
 void
 reload_games(void)
@@ -52,47 +102,28 @@ reload_games(void)
 #endif
 
 struct Buffer
-newBuffer(int width, int height, struct wl_shm *shm)
+newBuffer(int width, int height, struct ShmPool *pool)
 {
 	struct Buffer buf = {0};
 	int stride = width * 4;
 
-	int shm_pool_size = height * stride;
-
 	buf.width = width;
 	buf.height = height;
 	buf.stride = stride;
-	buf.data_sz = shm_pool_size;
-
-	buf.fd = allocate_shm_file(shm_pool_size);
-	if (buf.fd < 0) {
-		fprintf(stderr, "Failed to allocate shm file\n");
-		exit(1);
-	}
-
-	buf.data = mmap(NULL, shm_pool_size, PROT_READ | PROT_WRITE,
-			MAP_SHARED, buf.fd, 0);
-	if (buf.data == MAP_FAILED) {
-		perror("mmap");
-		close(buf.fd);
-		exit(1);
-	}
+	buf.data_sz = height * stride;
 
-	struct wl_shm_pool *pool = wl_shm_create_pool(shm, buf.fd, shm_pool_size);
-	if (pool == NULL) {
-		fprintf(stderr, "Failed to create pool\n");
-		close(buf.fd);
-		munmap(buf.data, shm_pool_size);
+	if (!shm_pool_alloc(pool, buf.data_sz, &buf.offset)) {
+		fprintf(stderr, "Failed to allocate shm buffer\n");
 		exit(1);
 	}
+	buf.data = pool->data + buf.offset;
 
-	buf.wl_buf = wl_shm_pool_create_buffer(pool, 0, width,
+	buf.wl_buf = wl_shm_pool_create_buffer(pool->pool, buf.offset, width,
 			height, stride, WL_SHM_FORMAT_ARGB8888);
 	if (buf.wl_buf == NULL) {
 		fprintf(stderr, "Failed to create buffer\n");
 		exit(1);
 	}
-	wl_shm_pool_destroy(pool);
 
 	buf.surf = cairo_image_surface_create_for_data(
 			(unsigned char *)buf.data, CAIRO_FORMAT_ARGB32,
@@ -113,7 +144,7 @@ newBuffer(int width, int height, struct wl_shm *shm)
 }
 
 void
-freeBuffer(struct Buffer *buf)
+freeBuffer(struct Buffer *buf, struct ShmPool *pool)
 {
 	if (buf->data == NULL) {
 		return;
@@ -123,15 +154,64 @@ freeBuffer(struct Buffer *buf)
 	cairo_destroy(buf->cr);
 
 	wl_buffer_destroy(buf->wl_buf);
-	close(buf->fd);
+	shm_pool_free(pool, buf->offset);
 
-	munmap(buf->data, buf->data_sz);
 	buf->data = NULL;
 	buf->data_sz = 0;
+	buf->offset = 0;
 	buf->surf = NULL;
 	buf->cr = NULL;
 	buf->wl_buf = NULL;
-	buf->fd = -1;
+}
+
+// Whether nextBuffer would return anything.
+static bool
+hasFreeBuffer(struct State *state)
+{
+	for (int i = 0; i < MAX_BUFFERS; i++) {
+		struct Buffer *buf = &state->buffers[i];
+		if (!buf->busy && buf != state->render.target)
+			return true;
+	}
+	return false;
+}
+
+static void
+wl_buffer_handle_release(void *data, struct wl_buffer *wl_buffer)
+{
+	struct Buffer *buf = data;
+	buf->busy = false;
+}
+
+static const struct wl_buffer_listener wl_buffer_listener = {
+	.release = wl_buffer_handle_release,
+};
+
+// Returns a buffer the compositor has released and that isn't being drawn
+// into, reallocating it if its size doesn't match the window. Returns NULL
+// if every slot is still busy.
+static struct Buffer *
+nextBuffer(struct State *state)
+{
+	struct Buffer *slot = NULL;
+	for (int i = 0; i < MAX_BUFFERS; i++) {
+		struct Buffer *buf = &state->buffers[i];
+		if (buf->busy || buf == state->render.target)
+			continue;
+		if (buf->data != NULL && buf->width == state->width &&
+				buf->height == state->height)
+			return buf;
+		if (slot == NULL)
+			slot = buf;
+	}
+	if (slot == NULL)
+		return NULL;
+
+	freeBuffer(slot, state->pool);
+	*slot = newBuffer(state->width, state->height, state->pool);
+	state->render.buffer_allocs++;
+	wl_buffer_add_listener(slot->wl_buf, &wl_buffer_listener, slot);
+	return slot;
 }
 
 void
@@ -150,8 +230,10 @@ xdg_surface_handle_configure(void *data, struct xdg_surface *xdg_surface,
 {
 	struct State *state = data;
 	xdg_surface_ack_configure(xdg_surface, serial);
-	state->configured = true;
-	state->redraw = true;
+	pthread_mutex_lock(&state->render.lock);
+	state->render.configured = true;
+	state->render.redraw = true;
+	pthread_mutex_unlock(&state->render.lock);
 }
 
 static const struct xdg_surface_listener xdg_surface_listener = {
@@ -218,40 +300,112 @@ keyboard_handle_keymap(void *data, struct wl_keyboard *wl_keyboard,
 	close(fd);
 }
 
-// returns a boolean indicating if the key was handled, this would be useful
-// when deciding to handle key repeat.
-bool
-handle_key(struct State *state, xkb_keysym_t keysym, bool released)
+// Keys that are handled by controlKey instead of the games when pressed.
+static bool
+isControlKey(xkb_keysym_t keysym)
 {
-	if (!released && (keysym == XKB_KEY_q || keysym == XKB_KEY_Escape)) {
+	return keysym == XKB_KEY_q || keysym == XKB_KEY_Escape ||
+		keysym == XKB_KEY_F3 || keysym == XKB_KEY_F5;
+}
+
+// Runs on the render thread before the game sees the rest of the input.
+static void
+controlKey(struct State *state, xkb_keysym_t keysym)
+{
+	switch (keysym) {
+	case XKB_KEY_q:
+	case XKB_KEY_Escape:
 		if (state->cur_game < 0) {
-			state->quit = true;
+			pthread_mutex_lock(&state->render.lock);
+			state->render.quit = true;
+			pthread_mutex_unlock(&state->render.lock);
 		} else {
 			games[state->cur_game].fini(state);
 			state->cur_game = -1;
 		}
-		state->redraw = true;
-
-		return false;
-	}
-	if (!released && keysym == XKB_KEY_F5) {
+		break;
+	case XKB_KEY_F3:
+		state->hud.visible = !state->hud.visible;
+		break;
+	case XKB_KEY_F5:
 #if HOTRELOAD
+		// Games may have threads running code from libgames.so, like
+		// the tetris bot's workers, they're stopped before it is
+		// unloaded and the game starts over with the new code.
+		if (state->cur_game >= 0)
+			games[state->cur_game].fini(state);
 		reload_games();
+		if (state->cur_game >= 0)
+			games[state->cur_game].init(state);
+		state->damage.all = true;
 #endif
-		state->redraw = true;
-		return false;
+		break;
 	}
+	state->redraw = true;
+}
 
-	assert(state->input.keys_len+1 < MAX_INPUT_KEYS);
-	state->input.keys[state->input.keys_len].keysym = keysym;
-	if (released) {
-		state->input.keys[state->input.keys_len].state = KEY_RELEASED;
-	} else {
-		state->input.keys[state->input.keys_len].state = KEY_PRESSED;
+// Queues a key for the render thread, this is the only producer of
+// render.input.
+static void
+queueKey(struct State *state, xkb_keysym_t keysym, enum KeyState keyState,
+		double time, uint32_t msec)
+{
+	struct InputEvent ev = {
+		.keysym = keysym,
+		.state = keyState,
+		.time = time,
+		.msec = msec,
+	};
+	// The render thread is that far behind, there is nothing better to
+	// do than to drop the key, but it is counted and reported.
+	if (!input_ring_push(&state->render.input, &ev)) {
+		int dropped = state->render.input.dropped;
+		if ((dropped & (dropped - 1)) == 0) {
+			fprintf(stderr, "input queue full, %d keys dropped\n",
+					dropped);
+		}
 	}
-	state->input.keys_len += 1;
+}
 
-	return true;
+// Queues a repeat for every time the repeat timer expired since it was
+// last read, timed when each of them happened.
+static void
+queueRepeats(struct State *state)
+{
+	uint64_t count = readCounter(state->repeat_key.fd, "key repeat error");
+	if (count == 0)
+		return;
+
+	struct itimerspec timer;
+	if (timerfd_gettime(state->repeat_key.fd, &timer) < 0) {
+		perror("timerfd_gettime: key repeat");
+		exit(1);
+	}
+	double t = now();
+	double interval = timer.it_interval.tv_sec + timer.it_interval.tv_nsec / 1e9;
+	// the next expiration is due in it_value, the last one was an
+	// interval before that.
+	double last = t + timer.it_value.tv_sec + timer.it_value.tv_nsec / 1e9 -
+		interval;
+	if (last > t)
+		last = t;
+	for (uint64_t i = 0; i < count; i++) {
+		double time = last - (count - 1 - i) * interval;
+		uint32_t msec = state->repeat_key.msec +
+			(uint32_t)((time - state->repeat_key.time) * 1000);
+		queueKey(state, state->repeat_key.keysym, KEY_REPEAT, time, msec);
+	}
+}
+
+// returns a boolean indicating if the key goes to the game, only those
+// repeat.
+bool
+handle_key(struct State *state, xkb_keysym_t keysym, bool released,
+		uint32_t msec)
+{
+	queueKey(state, keysym, released ? KEY_RELEASED : KEY_PRESSED, now(),
+			msec);
+	return !isControlKey(keysym);
 }
 
 void
@@ -260,6 +414,9 @@ keyboard_handle_key(void *data, struct wl_keyboard *wl_keyboard, uint32_t
 {
 	struct State *state = data;
 
+	// repeats that haven't been read yet happened before this key.
+	if (state->repeat_key.fd != -1)
+		queueRepeats(state);
 	const struct itimerspec zero_value = {0};
 	if (state->repeat_key.fd != -1 &&
 			timerfd_settime(state->repeat_key.fd, 0, &zero_value, NULL) < 0) {
@@ -277,14 +434,16 @@ keyboard_handle_key(void *data, struct wl_keyboard *wl_keyboard, uint32_t
 	xkb_keysym_t keysym = xkb_state_key_get_one_sym(state->xkb_state, key);
 
 	if (keyState != WL_KEYBOARD_KEY_STATE_PRESSED) {
-		handle_key(state, keysym, true);
+		handle_key(state, keysym, true, time);
 		return;
 	}
 
-	if (handle_key(state, keysym, false) && state->repeat_key.fd != -1 &&
+	if (handle_key(state, keysym, false, time) && state->repeat_key.fd != -1 &&
 			xkb_keymap_key_repeats(state->xkb_keymap, key) &&
 			state->repeat_rate != 0) {
 		state->repeat_key.keysym = keysym;
+		state->repeat_key.time = now();
+		state->repeat_key.msec = time;
 		struct itimerspec t = {
 			.it_value = {
 				.tv_sec = 0,
@@ -407,6 +566,18 @@ static struct wl_callback_listener cursor_callback_listener = {
 	.done = cursor_callback,
 };
 
+// Only animated cursors need frame callbacks, a static one would just wake us
+// up every frame for nothing.
+static void
+animate_cursor(struct State *state)
+{
+	if (state->pointer.animating || state->pointer.cursor->image_count <= 1)
+		return;
+	struct wl_callback *cb = wl_surface_frame(state->pointer.surface);
+	wl_callback_add_listener(cb, &cursor_callback_listener, state);
+	state->pointer.animating = true;
+}
+
 static void
 render_cursor(struct State *state)
 {
@@ -433,6 +604,7 @@ set_cursor(struct State *state, int cursor)
 		state->pointer.curimg = 0;
 		state->pointer.cursor = wayland_cursors[cursor].cursor;
 	}
+	animate_cursor(state);
 	render_cursor(state);
 }
 
@@ -442,10 +614,9 @@ cursor_callback(void *data, struct wl_callback *cb, uint32_t time)
 	static uint32_t prevtime = 0;
 	struct State *state = data;
 	wl_callback_destroy(cb);
+	state->pointer.animating = false;
 
-	cb = wl_surface_frame(state->pointer.surface);
-	wl_callback_add_listener(cb, &cursor_callback_listener, state);
-
+	animate_cursor(state);
 	render_cursor(state);
 
 	if (state->pointer.cursor->image_count > 1) {
@@ -599,6 +770,151 @@ static const struct wl_registry_listener registry_listener = {
 	.global_remove = handle_global_remove,
 };
 
+// Frames that took longer than this and than the game asked to wait (the
+// window was hidden) are simulated as if they took this long.
+#define MAX_FRAME_TIME 0.25
+
+static int
+compareDouble(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+// p is in the range [0, 1], sorted must be sorted in ascending order.
+static double
+percentile(double *sorted, int n, double p)
+{
+	int i = p * (n - 1) + 0.5;
+	return sorted[i];
+}
+
+static void
+hudRecord(struct Hud *hud, double start, double work)
+{
+	hud->start[hud->head] = start;
+	hud->work[hud->head] = work;
+	hud->head = (hud->head + 1) % HUD_FRAMES;
+	if (hud->len < HUD_FRAMES)
+		hud->len++;
+}
+
+// i = 0 is the oldest frame in the ring.
+static int
+hudIndex(struct Hud *hud, int i)
+{
+	return (hud->head - hud->len + i + HUD_FRAMES) % HUD_FRAMES;
+}
+
+static void
+hudRenderText(struct State *state, struct Buffer *buf)
+{
+	struct Hud *hud = &state->hud;
+	double fps = 0, p50 = 0, p99 = 0;
+
+	if (hud->len > 1) {
+		double span = hud->start[hudIndex(hud, hud->len - 1)] -
+			hud->start[hudIndex(hud, 0)];
+		if (span > 0)
+			fps = (hud->len - 1) / span;
+	}
+	if (hud->len > 0) {
+		for (int i = 0; i < hud->len; i++)
+			hud->sorted[i] = hud->work[i];
+		qsort(hud->sorted, hud->len, sizeof(*hud->sorted), compareDouble);
+		p50 = percentile(hud->sorted, hud->len, 0.5);
+		p99 = percentile(hud->sorted, hud->len, 0.99);
+	}
+
+	char lines[3][64];
+	snprintf(lines[0], sizeof(lines[0]), "%.0f fps  p50 %.2f  p99 %.2f ms",
+			fps, p50 * 1000, p99 * 1000);
+	snprintf(lines[1], sizeof(lines[1]), "%dx%d  allocs %d  pool %zu MiB",
+			buf->width, buf->height, hud->buffer_allocs,
+			hud->pool_size >> 20);
+	snprintf(lines[2], sizeof(lines[2]), "input to screen %.1f ms",
+			hud->input_latency * 1000);
+
+	cairo_t *cr = cairo_create(hud->text_surf);
+	cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_rgba(cr, 0, 0, 0, 0);
+	cairo_paint(cr);
+	cairo_set_operator(cr, CAIRO_OPERATOR_OVER);
+
+	cairo_set_font_size(cr, 13);
+	cairo_set_source_rgba(cr, 1, 1, 1, 1);
+	for (int i = 0; i < (int)ARRAY_LEN(lines); i++) {
+		cairo_move_to(cr, 4, 16 + i * 17);
+		cairo_show_text(cr, lines[i]);
+	}
+	cairo_destroy(cr);
+	cairo_surface_flush(hud->text_surf);
+}
+
+// Draws the overlay in the top left corner of buf and returns the area it
+// covered. The graph is written straight into the pixels, the only cairo
+// drawing per frame is compositing the cached text.
+static struct Rect
+hudDraw(struct State *state, struct Buffer *buf, double t)
+{
+	struct Hud *hud = &state->hud;
+	struct Rect r = {
+		.x = 8,
+		.y = 8,
+		.w = HUD_FRAMES,
+		.h = HUD_TEXT_HEIGHT + HUD_GRAPH_HEIGHT,
+	};
+	if (r.x + r.w > buf->width || r.y + r.h > buf->height)
+		return (struct Rect){0};
+
+	if (hud->text_surf == NULL) {
+		hud->text_surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+				HUD_FRAMES, HUD_TEXT_HEIGHT);
+		hud->text_time = 0;
+	}
+	if (t - hud->text_time >= HUD_TEXT_INTERVAL) {
+		hudRenderText(state, buf);
+		hud->text_time = t;
+	}
+
+	cairo_surface_flush(buf->surf);
+	for (int y = r.y; y < r.y + r.h; y++) {
+		uint32_t *row = (uint32_t *)(buf->data + y * buf->stride);
+		for (int x = r.x; x < r.x + r.w; x++) {
+			row[x] = 0xff000000 | ((row[x] >> 2) & 0x3f3f3f);
+		}
+	}
+
+	// bars are scaled so the budget is half way up the graph.
+	int bottom = r.y + r.h - 1;
+	for (int i = 0; i < hud->len; i++) {
+		double work = hud->work[hudIndex(hud, i)];
+		int h = work / (HUD_BUDGET * 2) * HUD_GRAPH_HEIGHT;
+		if (h > HUD_GRAPH_HEIGHT)
+			h = HUD_GRAPH_HEIGHT;
+		if (h < 1)
+			h = 1;
+		uint32_t color = work > HUD_BUDGET ? 0xffe04040 : 0xff40c040;
+		int x = r.x + HUD_FRAMES - hud->len + i;
+		for (int y = bottom; y > bottom - h; y--) {
+			((uint32_t *)(buf->data + y * buf->stride))[x] = color;
+		}
+	}
+	uint32_t *budget = (uint32_t *)(buf->data +
+			(bottom - HUD_GRAPH_HEIGHT / 2) * buf->stride);
+	for (int x = r.x; x < r.x + r.w; x += 4) {
+		budget[x] = 0xffffffff;
+	}
+	cairo_surface_mark_dirty_rectangle(buf->surf, r.x, r.y, r.w, r.h);
+
+	cairo_set_source_surface(buf->cr, hud->text_surf, r.x, r.y);
+	cairo_rectangle(buf->cr, r.x, r.y, HUD_FRAMES, HUD_TEXT_HEIGHT);
+	cairo_fill(buf->cr);
+
+	return r;
+}
+
 static void wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t time);
 
 static struct wl_callback_listener wl_surface_frame_listener = {
@@ -606,52 +922,414 @@ static struct wl_callback_listener wl_surface_frame_listener = {
 };
 
 static void
-wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t time)
+requestFrame(struct State *state)
 {
-	static uint32_t prevTime = 0;
-	struct State *state = data;
+	struct wl_callback *cb = wl_surface_frame(state->surface);
+	wl_callback_add_listener(cb, &wl_surface_frame_listener, state);
+	state->frame_pending = true;
+}
 
-	wl_callback_destroy(cb);
+// Whether anything would change if we drew a frame right now, called on
+// the wayland thread with render.lock held.
+static bool
+needsFrame(struct State *state)
+{
+	if (state->render.redraw || state->render.configured ||
+			!input_ring_empty(&state->render.input))
+		return true;
+	return state->deadline >= 0 && now() >= state->deadline;
+}
 
-	cb = wl_surface_frame(state->surface);
-	wl_callback_add_listener(cb, &wl_surface_frame_listener, state);
+static void
+recordFrame(struct State *state, double dt)
+{
+	static struct ReplayFrame frame;
+	frame.dt = dt;
+	frame.game = state->cur_game;
+	frame.keys_len = state->input.keys_len;
+	for (size_t i = 0; i < state->input.keys_len; i++) {
+		frame.keys[i].keysym = state->input.keys[i].keysym;
+		frame.keys[i].state = state->input.keys[i].state;
+	}
+	replay_write_frame(state->record, state->buffer->width,
+			state->buffer->height, &frame);
+}
 
-	if (state->configured) {
-		struct Buffer prev = state->buffer;
-		state->buffer = newBuffer(state->width, state->height, state->shm);
-		freeBuffer(&prev);
+// Applies a recorded frame to state, returns false if the replay no longer
+// matches what the games are doing.
+static bool
+replayFrame(struct State *state, struct ReplayFrame *frame)
+{
+	if (frame->game != state->cur_game) {
+		if (frame->game >= 0 || state->cur_game < 0)
+			return false;
+		// the game was left with q or Escape.
+		games[state->cur_game].fini(state);
+		state->cur_game = -1;
+	}
+
+	state->input.keys_len = frame->keys_len;
+	for (uint32_t i = 0; i < frame->keys_len; i++) {
+		state->input.keys[i].keysym = frame->keys[i].keysym;
+		state->input.keys[i].state = frame->keys[i].state;
+		state->input.keys[i].time = 0;
+		state->input.keys[i].msec = 0;
+	}
+	return true;
+}
+
+// Updates the current game once per TICK_DT of elapsed time and draws it
+// in between the last two updates. Returns whether the input was used, it
+// is taken out of state->input then so keys a game queues while updating,
+// like the tetris bot's, wait there for the next frame.
+static bool
+runGame(struct State *state, double dt)
+{
+	static struct Input input;
+	int g = state->cur_game;
+	if (g < 0) {
+		state->tick_accum = 0;
+		input_take(&input, &state->input);
+		PROF_BEGIN(state, "updateDraw");
+		selectUpdateDraw(state, &input, dt);
+		PROF_END(state);
+		return true;
+	}
+
+	bool updated = false;
+	state->tick_accum += dt;
+	PROF_BEGIN(state, "update");
+	while (state->tick_accum >= TICK_DT) {
+		state->tick_accum -= TICK_DT;
+		// input goes to the first update, the rest catch up.
+		static const struct Input noInput;
+		if (!updated)
+			input_take(&input, &state->input);
+		games[g].update(state, updated ? &noInput : &input);
+		updated = true;
+		if (state->cur_game != g)
+			break;
+	}
+	PROF_END(state);
+
+	if (state->cur_game != g) {
+		state->tick_accum = 0;
+		return updated;
+	}
+	PROF_BEGIN(state, "draw");
+	games[g].draw(state, state->tick_accum / TICK_DT);
+	PROF_END(state);
+	return updated;
+}
 
+// Moves the keys the wayland thread queued since the last frame over to
+// state->input. The ring needs no lock, the wayland thread keeps pushing
+// while this runs.
+static void
+takeInput(struct State *state)
+{
+	const struct InputEvent *ev;
+	while ((ev = input_ring_peek(&state->render.input)) != NULL) {
+		if (ev->state == KEY_PRESSED && isControlKey(ev->keysym)) {
+			controlKey(state, ev->keysym);
+		} else if (!input_append(&state->input, ev)) {
+			// input still waiting for an update filled it up, the
+			// rest stays queued for the next frame.
+			break;
+		}
+		input_ring_pop(&state->render.input);
+	}
+}
+
+// Moves the requests the wayland thread made since the last frame over to
+// the render thread's side of state. Called with render.lock held.
+static void
+takeRequests(struct State *state)
+{
+	if (state->render.configured) {
+		state->render.configured = false;
+		state->configured = true;
+	}
+	if (state->render.redraw) {
+		state->render.redraw = false;
+		state->redraw = true;
+	}
+	state->hud.buffer_allocs = state->render.buffer_allocs;
+	state->hud.pool_size = state->pool->size;
+	state->hud.input_latency = state->render.input_latency;
+}
+
+// Updates and draws the current game into buf on the render thread, the
+// damage is left in state for commitFrame. Returns whether anything was
+// drawn, inputMsec is set to the compositor time of the oldest key the
+// frame used.
+static bool
+renderFrame(struct State *state, struct Buffer *buf, uint32_t *inputMsec)
+{
+	static double prevTime = 0;
+	static int prevGame = -1;
+	static bool prevHud = false;
+
+	PROF_BEGIN(state, "frame");
+	state->buffer = buf;
+
+	bool fullDamage = false;
+	if (state->configured) {
 		state->configured = false;
 		state->redraw = true;
+		fullDamage = true;
 	}
 
-	double dt = (time - prevTime) / 1000.0;
-	if (prevTime == 0) {
-		dt = 1.0 / 60.0;
+	double t = now();
+	double dt = t - prevTime;
+	if (prevTime == 0 || state->deadline < 0) {
+		// an idle game only needs one update for whatever woke it.
+		dt = TICK_DT;
+	} else {
+		// Sleeping until the deadline the game asked for, or being woken
+		// by a key before it, is no stall even when that is longer than
+		// MAX_FRAME_TIME, only the time past the deadline is dropped.
+		double maxDt = state->deadline - prevTime;
+		if (maxDt < MAX_FRAME_TIME)
+			maxDt = MAX_FRAME_TIME;
+		if (dt > maxDt)
+			dt = maxDt;
 	}
-	prevTime = time;
+	prevTime = t;
 
 	int g = state->cur_game;
 	assert(g < GAMES_COUNT);
+	if (state->record) {
+		recordFrame(state, dt);
+	}
+	if (g != prevGame) {
+		fullDamage = true;
+		prevGame = g;
+	}
+	if (state->hud.visible != prevHud) {
+		fullDamage = true;
+		prevHud = state->hud.visible;
+	}
 
-	if (g < 0) {
-		selectUpdateDraw(state, state->input, dt);
-	} else {
-		games[g].updateDraw(state, state->input, dt);
+	// Input arriving between updates waits for the next one. Keys the games
+	// queue themselves have no timestamp.
+	uint32_t msec = 0;
+	for (size_t i = 0; i < state->input.keys_len && msec == 0; i++)
+		msec = state->input.keys[i].msec;
+	*inputMsec = 0;
+	if (runGame(state, dt))
+		*inputMsec = msec;
+	if (state->damage.all) {
+		fullDamage = true;
 	}
-	state->input.keys_len = 0;
 
-	if (state->redraw) {
-		wl_surface_attach(state->surface, state->buffer.wl_buf, 0, 0);
-		wl_surface_damage_buffer(state->surface, 0, 0,
-				state->width, state->height);
+	if (state->redraw && state->hud.visible) {
+		PROF_BEGIN(state, "hud");
+		struct Rect r = hudDraw(state, buf, t);
+		// no damage means the whole buffer is damaged already.
+		if (fullDamage || state->damage.len == MAX_DAMAGE_RECTS) {
+			fullDamage = true;
+		} else if (state->damage.len > 0) {
+			state->damage.rects[state->damage.len++] = r;
+		}
+		PROF_END(state);
+	}
+	if (fullDamage) {
+		state->damage.all = true;
 	}
-	state->redraw = false;
-	wl_surface_commit(state->surface);
 
+	bool drawn = state->redraw;
+	state->redraw = false;
 	if (g < 0 && state->cur_game >= 0) {
 		state->redraw = true;
 	}
+
+	hudRecord(&state->hud, t, now() - t);
+	PROF_END(state);
+	return drawn;
+}
+
+// When the current game wants its next frame, relative to now.
+static double
+nextTick(struct State *state)
+{
+	if (state->redraw)
+		return TICK_NOW;
+	double tick = TICK_IDLE;
+	if (state->cur_game >= 0) {
+		tick = games[state->cur_game].nextTick(state);
+	}
+	// input that came in between updates is used by the next one.
+	if (state->input.keys_len > 0 && state->cur_game >= 0) {
+		double update = TICK_DT - state->tick_accum;
+		if (tick < 0 || update < tick)
+			tick = update;
+	}
+	return tick;
+}
+
+static void *
+renderThread(void *data)
+{
+	struct State *state = data;
+
+	pthread_mutex_lock(&state->render.lock);
+	for (;;) {
+		while (!state->render.exit &&
+				(state->render.target == NULL || state->render.done))
+			pthread_cond_wait(&state->render.cond, &state->render.lock);
+		if (state->render.exit)
+			break;
+		struct Buffer *buf = state->render.target;
+		takeRequests(state);
+		pthread_mutex_unlock(&state->render.lock);
+		takeInput(state);
+
+		uint32_t inputMsec;
+		bool drawn = renderFrame(state, buf, &inputMsec);
+		double tick = nextTick(state);
+
+		pthread_mutex_lock(&state->render.lock);
+		state->render.done = true;
+		state->render.show = drawn;
+		state->render.input_msec = inputMsec;
+		state->deadline = tick < 0 ? -1 : now() + tick;
+
+		uint64_t one = 1;
+		if (write(state->render.wake_fd, &one, sizeof(one)) < 0) {
+			perror("write: waking up the wayland thread");
+			exit(1);
+		}
+	}
+	pthread_mutex_unlock(&state->render.lock);
+	return NULL;
+}
+
+// Attaches the frame the render thread finished, once the compositor is
+// ready for another one. Called with render.lock held.
+static void
+commitFrame(struct State *state)
+{
+	struct Buffer *buf = state->render.target;
+	if (buf == NULL || !state->render.done)
+		return;
+	if (state->render.quit)
+		state->quit = true;
+	if (state->render.show && state->frame_pending)
+		return;
+
+	if (state->render.show) {
+		PROF_BEGIN_ON(state->wl_prof, "commit");
+		// Even games that are idle get one more frame callback after
+		// this one, it keeps us from drawing faster than the compositor
+		// when input comes in quickly.
+		requestFrame(state);
+		state->pending_msec = state->render.input_msec;
+		wl_surface_attach(state->surface, buf->wl_buf, 0, 0);
+		if (state->damage.all || state->damage.len == 0) {
+			wl_surface_damage_buffer(state->surface, 0, 0,
+					buf->width, buf->height);
+		} else {
+			for (int i = 0; i < state->damage.len; i++) {
+				struct Rect r = state->damage.rects[i];
+				wl_surface_damage_buffer(state->surface,
+						r.x, r.y, r.w, r.h);
+			}
+		}
+		buf->busy = true;
+		wl_surface_commit(state->surface);
+		PROF_END_ON(state->wl_prof);
+	}
+	state->damage.len = 0;
+	state->damage.all = false;
+	state->render.target = NULL;
+	state->render.done = false;
+	state->render.show = false;
+	state->render.input_msec = 0;
+}
+
+// Hands the render thread a free buffer for the next frame if it's idle and
+// the frame would change anything. This runs right after a commit, so the
+// next frame is drawn while the compositor shows the last one. Called with
+// render.lock held.
+static void
+startFrame(struct State *state)
+{
+	if (state->render.target != NULL || !needsFrame(state))
+		return;
+	// The compositor is still reading all of our buffers, the input and
+	// the elapsed time wait until one is released.
+	struct Buffer *buf = nextBuffer(state);
+	if (buf == NULL)
+		return;
+	state->render.target = buf;
+	pthread_cond_signal(&state->render.cond);
+}
+
+static void
+wl_surface_frame_done(void *data, struct wl_callback *cb, uint32_t time)
+{
+	struct State *state = data;
+
+	wl_callback_destroy(cb);
+	state->frame_pending = false;
+	// time and the keys' timestamps are both from the compositor's clock.
+	if (state->pending_msec != 0) {
+		pthread_mutex_lock(&state->render.lock);
+		state->render.input_latency = (uint32_t)(time - state->pending_msec) / 1000.0;
+		pthread_mutex_unlock(&state->render.lock);
+		state->pending_msec = 0;
+	}
+}
+
+// Arms the game timer for the current deadline, or disarms it while the
+// render thread is busy or has no buffer to draw into. Called with
+// render.lock held.
+static void
+armGameTimer(struct State *state)
+{
+	double at = -1;
+	if (state->render.target == NULL && state->deadline >= 0 &&
+			hasFreeBuffer(state))
+		at = state->deadline;
+	if (at == state->game_timer.at)
+		return;
+	state->game_timer.at = at;
+
+	struct itimerspec t = {0};
+	if (at >= 0) {
+		t.it_value.tv_sec = (time_t)at;
+		t.it_value.tv_nsec = (long)((at - t.it_value.tv_sec) * 1e9);
+		// zero would disarm it, any time in the past fires right away.
+		if (t.it_value.tv_sec == 0 && t.it_value.tv_nsec == 0)
+			t.it_value.tv_nsec = 1;
+	}
+	if (timerfd_settime(state->game_timer.fd, TFD_TIMER_ABSTIME, &t, NULL) < 0) {
+		perror("timerfd_settime: game timer");
+		exit(1);
+	}
+}
+
+// What woke up the main loop, kept in epoll_event.data.
+enum EventSource {
+	EVENT_WAYLAND,
+	EVENT_RENDER,
+	EVENT_REPEAT,
+	EVENT_TIMER,
+	EVENT_SIGNAL,
+};
+
+static void
+watchFd(int epoll_fd, int fd, enum EventSource source)
+{
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u32 = source,
+	};
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl");
+		exit(1);
+	}
 }
 
 void
@@ -670,6 +1348,15 @@ wayland_init(struct State *state)
 		fprintf(stderr, "no wl_shm, xdg_wm_base or wl_compositor\n");
 		exit(1);
 	}
+
+	// Room for the whole swap chain at the initial size, it grows on
+	// demand when the window does.
+	state->pool = shm_pool_create(state->shm,
+			(size_t)MAX_BUFFERS * state->width * state->height * 4);
+	if (state->pool == NULL) {
+		fprintf(stderr, "Failed to create shm pool\n");
+		exit(1);
+	}
 }
 
 void
@@ -697,23 +1384,22 @@ wayland_open(struct State *state, char *name)
 
 	init_cursor(state);
 
-	state->buffer = newBuffer(state->width, state->height, state->shm);
+	state->buffer = nextBuffer(state);
 
 	wl_surface_commit(state->surface);
 	wl_display_roundtrip(state->display);
 
-	struct wl_callback *cb = wl_surface_frame(state->surface);
-	wl_callback_add_listener(cb, &wl_surface_frame_listener, state);
+	requestFrame(state);
 
 	wl_surface_damage_buffer(state->surface, 0, 0, state->width, state->height);
 	wl_surface_commit(state->surface);
 
 	wl_display_roundtrip(state->display);
-	wl_surface_attach(state->surface, state->buffer.wl_buf, 0, 0);
+	wl_surface_attach(state->surface, state->buffer->wl_buf, 0, 0);
+	state->buffer->busy = true;
 	wl_surface_commit(state->surface);
 
-	cb = wl_surface_frame(state->pointer.surface);
-	wl_callback_add_listener(cb, &cursor_callback_listener, state);
+	animate_cursor(state);
 }
 
 
@@ -728,7 +1414,11 @@ wayland_fini(struct State *state)
 	wl_cursor_theme_destroy(state->pointer.theme);
 	wl_surface_destroy(state->pointer.surface);
 
-	freeBuffer(&state->buffer);
+	for (int i = 0; i < MAX_BUFFERS; i++)
+		freeBuffer(&state->buffers[i], state->pool);
+	shm_pool_destroy(state->pool);
+	if (state->hud.text_surf)
+		cairo_surface_destroy(state->hud.text_surf);
 
 	if (state->xkb_keymap)
 		xkb_keymap_unref(state->xkb_keymap);
@@ -745,6 +1435,99 @@ wayland_fini(struct State *state)
 	wl_display_disconnect(state->display);
 }
 
+// Runs the current game for the given number of frames without a compositor
+// and prints how long each frame took. Every frame is redrawn, as if the
+// window was being resized, so the numbers include the drawing cost.
+//
+// With a replay the input and frame times come from the log instead, and it
+// runs until the log ends unless frames is smaller.
+static void
+headlessRun(struct State *state, int frames, struct Replay *replay)
+{
+	struct Buffer buf = {0};
+	buf.surf = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+			state->width, state->height);
+	if (cairo_surface_status(buf.surf) != CAIRO_STATUS_SUCCESS) {
+		fprintf(stderr, "cairo: %s\n",
+				cairo_status_to_string(cairo_surface_status(buf.surf)));
+		exit(1);
+	}
+	buf.cr = cairo_create(buf.surf);
+	buf.width = state->width;
+	buf.height = state->height;
+	buf.stride = cairo_image_surface_get_stride(buf.surf);
+	buf.data = cairo_image_surface_get_data(buf.surf);
+	buf.data_sz = buf.stride * buf.height;
+	state->buffer = &buf;
+
+	struct {
+		double *data;
+		int len;
+		int cap;
+	} times = {0};
+	static struct ReplayFrame frame;
+
+	double dt = 1.0 / HEADLESS_RATE;
+	double gameTime = 0;
+	while (times.len < frames) {
+		if (replay) {
+			if (!replay_read_frame(replay, &frame))
+				break;
+			if (!replayFrame(state, &frame)) {
+				fprintf(stderr, "replay desynced at frame %d\n",
+						times.len);
+				break;
+			}
+			dt = frame.dt;
+		}
+		gameTime += dt;
+		state->redraw = true;
+
+		double start = now();
+		PROF_BEGIN(state, "frame");
+		runGame(state, dt);
+		cairo_surface_flush(buf.surf);
+		PROF_END(state);
+		APPEND(times, now() - start);
+
+		state->damage.len = 0;
+		state->damage.all = false;
+	}
+	int n = times.len;
+	if (n == 0) {
+		fprintf(stderr, "no frames were run\n");
+		exit(1);
+	}
+
+	double total = 0;
+	for (int i = 0; i < n; i++) {
+		total += times.data[i];
+	}
+	qsort(times.data, n, sizeof(*times.data), compareDouble);
+
+	char *name = state->cur_game < 0 ? "menu" : games[state->cur_game].name;
+	if (replay) {
+		printf("replay of %s %dx%d, %d frames, %.2f s of game time\n",
+				replay->path, state->width, state->height, n,
+				gameTime);
+	} else {
+		printf("%s %dx%d, %d frames at %d Hz\n", name, state->width,
+				state->height, n, HEADLESS_RATE);
+	}
+	printf("frame time (ms): min %.3f avg %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+			times.data[0] * 1000,
+			total / n * 1000,
+			percentile(times.data, n, 0.5) * 1000,
+			percentile(times.data, n, 0.9) * 1000,
+			percentile(times.data, n, 0.99) * 1000,
+			times.data[n-1] * 1000);
+
+	free(times.data);
+	cairo_destroy(buf.cr);
+	cairo_surface_destroy(buf.surf);
+	state->buffer = NULL;
+}
+
 bool
 hasSuffix(char *s, int len, char *suffix, int suffixlen)
 {
@@ -831,6 +1614,28 @@ gameFromArg(char *arg, int arg_len)
 	return -1;
 }
 
+static void
+usage(char *argv0)
+{
+	fprintf(stderr, "usage: %s [-AH] [-j threads] [-n frames] [-s WIDTHxHEIGHT] [-S seed] [-t trace.json]\n"
+			"\t[-b COLSxROWS] [-R record.log | -P record.log] [game]\n", argv0);
+	fprintf(stderr, "       %s -x solve|check|gen [-j threads] [-n count] [-S seed] [file]\n", argv0);
+	fprintf(stderr, "\t-H  run without a compositor and print frame times\n");
+	fprintf(stderr, "\t-n  number of frames to run with -H (default 600)\n");
+	fprintf(stderr, "\t-s  buffer size to use with -H (default 640x480)\n");
+	fprintf(stderr, "\t-R  record every frame's input to this file\n");
+	fprintf(stderr, "\t-P  play a recording back without a compositor, implies -H\n");
+	fprintf(stderr, "\t-b  snake board size (default %dx%d)\n",
+			SNAKE_DEFAULT_SIZE, SNAKE_DEFAULT_SIZE);
+	fprintf(stderr, "\t-S  seed for the random number generator (default: current time)\n");
+	fprintf(stderr, "\t-x  run the sudoku engine on puzzles from file or stdin, or\n"
+			"\t    benchmark the generator with -n puzzles per difficulty\n");
+	fprintf(stderr, "\t-A  let the bot play tetris, toggled with a while playing\n");
+	fprintf(stderr, "\t-j  threads to use with -x and for the tetris bot (default: one per cpu)\n");
+	fprintf(stderr, "\t-t  write a chrome trace of every frame to this file,\n"
+			"\t    $WL_GAMES_TRACE is used if it's not given\n");
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -838,15 +1643,131 @@ main(int argc, char *argv[])
 	reload_games();
 #endif
 
-	srand(time(NULL));
+	unsigned int seed = time(NULL);
 
 	char *argv0 = argv[0];
-	argv++;
-	argc--;
 
 	struct State state = {0};
 	initState(&state);
-	if (argc > 0) {
+
+	bool headless = false;
+	int frames = -1;
+	bool sizeSet = false;
+	char *trace = getenv("WL_GAMES_TRACE");
+	char *recordPath = NULL;
+	char *replayPath = NULL;
+	char *batchMode = NULL;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int opt;
+	while ((opt = getopt(argc, argv, "Ab:Hj:n:P:R:S:s:t:x:")) != -1) {
+		switch (opt) {
+		case 'A':
+			state.autoplay = true;
+			break;
+		case 'x':
+			batchMode = optarg;
+			break;
+		case 'j':
+			threads = atoi(optarg);
+			if (threads <= 0) {
+				fprintf(stderr, "invalid thread count %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'b':
+			if (sscanf(optarg, "%dx%d", &state.snake_cols, &state.snake_rows) != 2 ||
+					state.snake_cols <= 0 || state.snake_rows <= 0 ||
+					state.snake_cols > SNAKE_MAX_SIZE ||
+					state.snake_rows > SNAKE_MAX_SIZE) {
+				fprintf(stderr, "invalid snake board size %s, sides must be 1 to %d\n",
+						optarg, SNAKE_MAX_SIZE);
+				exit(1);
+			}
+			break;
+		case 'S':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			trace = optarg;
+			break;
+		case 'R':
+			recordPath = optarg;
+			break;
+		case 'P':
+			replayPath = optarg;
+			headless = true;
+			break;
+		case 'H':
+			headless = true;
+			break;
+		case 'n':
+			frames = atoi(optarg);
+			if (frames <= 0) {
+				fprintf(stderr, "invalid frame count %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &state.width, &state.height) != 2 ||
+					state.width <= 0 || state.height <= 0) {
+				fprintf(stderr, "invalid size %s\n", optarg);
+				exit(1);
+			}
+			sizeSet = true;
+			break;
+		default:
+			usage(argv0);
+			exit(1);
+		}
+	}
+	argv += optind;
+	argc -= optind;
+	state.threads = threads;
+
+	if (batchMode != NULL) {
+		return sudoku_batch(batchMode, argc > 0 ? argv[0] : NULL,
+				threads, frames > 0 ? frames : 100, seed);
+	}
+
+	if (trace != NULL && *trace != '\0') {
+		state.prof = prof_create(trace, headless ? "main" : "render");
+		if (state.prof == NULL) {
+			exit(1);
+		}
+	}
+
+	struct Replay *replay = NULL;
+	if (replayPath != NULL) {
+		if (recordPath != NULL) {
+			fprintf(stderr, "-R and -P can't be used together\n");
+			exit(1);
+		}
+		replay = replay_open(replayPath);
+		if (replay == NULL) {
+			exit(1);
+		}
+		seed = replay->header.seed;
+		state.snake_cols = replay->header.snake_cols;
+		state.snake_rows = replay->header.snake_rows;
+		if (state.snake_cols > SNAKE_MAX_SIZE || state.snake_rows > SNAKE_MAX_SIZE) {
+			fprintf(stderr, "%s: invalid snake board size\n", replayPath);
+			exit(1);
+		}
+		if (!sizeSet) {
+			state.width = replay->header.width;
+			state.height = replay->header.height;
+		}
+	}
+	rng_seed(&state.rng, seed, 0);
+
+	if (replay != NULL) {
+		if (replay->header.game >= (int)games_len) {
+			fprintf(stderr, "%s: unknown game %d\n", replayPath,
+					replay->header.game);
+			exit(1);
+		}
+		state.cur_game = replay->header.game;
+	} else if (argc > 0) {
 		int n = gameFromArg(*argv, strlen(*argv));
 		if (n < 0) {
 			fprintf(stderr, "unknown game %s\n", *argv);
@@ -860,10 +1781,53 @@ main(int argc, char *argv[])
 	} else {
 		state.cur_game = gameFromArg(argv0, strlen(argv0));
 	}
+	// SIGINT and SIGTERM end the main loop through a signalfd, they have
+	// to be blocked before games start any threads.
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	if (!headless) {
+		pthread_sigmask(SIG_BLOCK, &signals, NULL);
+	}
+
+	// Sudoku puzzles are generated from the start, so there are some
+	// ready by the time the game is entered. The pool has a stream of
+	// its own, the other games don't depend on it.
+	struct Rng poolRng;
+	rng_seed(&poolRng, seed, 1);
+	state.sudoku_pool = sudoku_pool_create(&poolRng);
+
 	if (state.cur_game >= 0) {
 		games[state.cur_game].init(&state);
 	}
 
+	if (headless) {
+		if (frames < 0) {
+			frames = replay ? INT_MAX : 600;
+		}
+		headlessRun(&state, frames, replay);
+		replay_close(replay);
+		if (state.cur_game >= 0) {
+			games[state.cur_game].fini(&state);
+		}
+		sudoku_pool_destroy(state.sudoku_pool);
+		prof_destroy(state.prof);
+		return 0;
+	}
+
+	if (recordPath != NULL) {
+		state.record = replay_create(recordPath, seed);
+		if (state.record == NULL) {
+			exit(1);
+		}
+		state.record->header.snake_cols = state.snake_cols;
+		state.record->header.snake_rows = state.snake_rows;
+	}
+
+	// the wayland handlers already take it.
+	pthread_mutex_init(&state.render.lock, NULL);
+	pthread_cond_init(&state.render.cond, NULL);
 	wayland_init(&state);
 	wayland_open(&state, "wl-games");
 
@@ -872,9 +1836,36 @@ main(int argc, char *argv[])
 		perror("Failed to create timerfd, can't handle key repeats");
 	}
 
-	fd_set fds;
-	int nfds = 0;
+	state.render.wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (state.render.wake_fd < 0) {
+		perror("eventfd");
+		exit(1);
+	}
+	state.game_timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (state.game_timer.fd < 0) {
+		perror("timerfd_create");
+		exit(1);
+	}
+	state.game_timer.at = -1;
+	int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (signal_fd < 0) {
+		perror("signalfd");
+		exit(1);
+	}
+
 	int wl_fd = wl_display_get_fd(state.display);
+	int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	watchFd(epoll_fd, wl_fd, EVENT_WAYLAND);
+	watchFd(epoll_fd, state.render.wake_fd, EVENT_RENDER);
+	watchFd(epoll_fd, state.game_timer.fd, EVENT_TIMER);
+	watchFd(epoll_fd, signal_fd, EVENT_SIGNAL);
+	if (state.repeat_key.fd != -1) {
+		watchFd(epoll_fd, state.repeat_key.fd, EVENT_REPEAT);
+	}
 
 	int ret = 1;
 	while (ret > 0) {
@@ -886,47 +1877,93 @@ main(int argc, char *argv[])
 		exit(1);
 	}
 
+	state.wl_prof = prof_create_thread(state.prof, "wayland");
+	int err = pthread_create(&state.render.thread, NULL, renderThread, &state);
+	if (err != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(1);
+	}
+
+	// The lock is only taken to hand frames to the render thread and back,
+	// the handlers that touch render take it themselves.
+	pthread_mutex_lock(&state.render.lock);
+	// the first frame is drawn as soon as the window is configured.
+	startFrame(&state);
+	pthread_mutex_unlock(&state.render.lock);
 	while (!state.quit) {
-		FD_ZERO(&fds);
-		FD_SET(wl_fd, &fds);
-		nfds = wl_fd;
-		if (state.repeat_key.fd != -1) {
-			FD_SET(state.repeat_key.fd, &fds);
-			if (nfds < state.repeat_key.fd)
-				nfds = state.repeat_key.fd;
-		}
-
-		select(nfds + 1, &fds, 0, 0, NULL);
-		if (state.repeat_key.fd != -1 && FD_ISSET(state.repeat_key.fd, &fds)) {
-			uint64_t expiration_count;
-			ssize_t ret = read(state.repeat_key.fd,
-					&expiration_count,
-					sizeof(expiration_count));
-			if (ret < 0) {
-				if (errno != EAGAIN) {
-					perror("key repeat error");
-				}
-			// silently ignore keypress if we don't have enough space.
-			} else if (state.input.keys_len+1 < MAX_INPUT_KEYS) {
-				xkb_keysym_t keysym = state.repeat_key.keysym;
-				state.input.keys[state.input.keys_len].keysym = keysym;
-				state.input.keys[state.input.keys_len].state = KEY_REPEAT;
-				state.input.keys_len += 1;
-			}
+		pthread_mutex_lock(&state.render.lock);
+		armGameTimer(&state);
+		pthread_mutex_unlock(&state.render.lock);
+		struct epoll_event events[8];
+		int n = epoll_wait(epoll_fd, events, ARRAY_LEN(events), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			exit(1);
 		}
 
-		if (FD_ISSET(wl_fd, &fds)) {
-			if (wl_display_dispatch(state.display) == -1) {
-				perror("wl_display_dispatch");
-				exit(1);
+		PROF_BEGIN_ON(state.wl_prof, "dispatch");
+		for (int i = 0; i < n; i++) {
+			switch (events[i].data.u32) {
+			case EVENT_WAYLAND:
+				if (wl_display_dispatch(state.display) == -1) {
+					perror("wl_display_dispatch");
+					exit(1);
+				}
+				break;
+			case EVENT_RENDER:
+				readCounter(state.render.wake_fd, "read: render thread wake up");
+				break;
+			case EVENT_TIMER:
+				// startFrame sees that the deadline passed.
+				readCounter(state.game_timer.fd, "read: game timer");
+				state.game_timer.at = -1;
+				break;
+			case EVENT_REPEAT:
+				queueRepeats(&state);
+				break;
+			case EVENT_SIGNAL: {
+				struct signalfd_siginfo info;
+				if (read(signal_fd, &info, sizeof(info)) == sizeof(info)) {
+					state.quit = true;
+				}
+				break;
 			}
-			if (wl_display_flush(state.display) == -1 ) {
-				perror("wl_display_flush");
-				exit(1);
 			}
 		}
+		PROF_END_ON(state.wl_prof);
+
+		pthread_mutex_lock(&state.render.lock);
+		commitFrame(&state);
+		startFrame(&state);
+		pthread_mutex_unlock(&state.render.lock);
+		PROF_BEGIN_ON(state.wl_prof, "flush");
+		if (wl_display_flush(state.display) == -1 ) {
+			perror("wl_display_flush");
+			exit(1);
+		}
+		PROF_END_ON(state.wl_prof);
 	}
+	pthread_mutex_lock(&state.render.lock);
+	state.render.exit = true;
+	pthread_cond_signal(&state.render.cond);
+	pthread_mutex_unlock(&state.render.lock);
+	pthread_join(state.render.thread, NULL);
+	pthread_mutex_destroy(&state.render.lock);
+	pthread_cond_destroy(&state.render.cond);
+	close(state.render.wake_fd);
+	close(state.game_timer.fd);
+	close(signal_fd);
+	close(epoll_fd);
 
+	if (state.cur_game >= 0) {
+		games[state.cur_game].fini(&state);
+	}
+	sudoku_pool_destroy(state.sudoku_pool);
 	wayland_fini(&state);
+	replay_close(state.record);
+	prof_destroy(state.wl_prof);
+	prof_destroy(state.prof);
 	return 0;
 }
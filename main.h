@@ -47,6 +47,13 @@ struct FVec2 {
 	float y;
 };
 
+struct Rect {
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
 struct FRect {
 	float x;
 	float y;
@@ -71,6 +78,9 @@ enum {
 	COLORS_COUNT,
 };
 
+#define SNAKE_DEFAULT_SIZE 16
+#define SNAKE_MAX_SIZE 4096
+
 struct Snake {
 	int x;
 	int y;
@@ -80,13 +90,31 @@ struct Snake {
 	int rows;
 	int cols;
 
+	// Ring buffer of the body behind the head, the segment at index
+	// head is right behind it and the last one is the end of the tail.
 	struct {
 		struct Vec2 *data;
+		int head;
 		int len;
 		int cap;
 	} tails;
+	// one bit per cell, set for the head and every tail segment.
+	uint64_t *occupied;
+	// number of moves so far, gives every segment a color that doesn't
+	// change as the snake moves.
+	int moves;
+
+	// The board with one pixel per cell, only the cells that change are
+	// written on a move and it gets scaled up when drawn.
+	cairo_surface_t *board;
 
 	struct Vec2 apple;
+	int apple_spawn;
+
+	double accum_time;
+	double interval;
+
+	struct Rng rng;
 
 	bool pause;
 	bool lost;
@@ -94,8 +122,22 @@ struct Snake {
 
 struct SudokuCell {
 	bool user_fill;
-	bool values[9];
+	// pencil marks, bit n-1 for n.
+	uint16_t marks;
 	char value;
+
+	// Kept up to date whenever a value on the board changes, drawing
+	// only reads them. conflict is set if value repeats in its row,
+	// column or box, and candidates are the digits that don't.
+	bool conflict;
+	uint16_t candidates;
+};
+
+enum {
+	SUDOKU_UNIT_ROW,
+	SUDOKU_UNIT_COL,
+	SUDOKU_UNIT_BOX,
+	SUDOKU_UNITS_COUNT,
 };
 
 struct Sudoku {
@@ -103,6 +145,34 @@ struct Sudoku {
 	int focus_x;
 
 	struct SudokuCell board[9][9];
+
+	// How many times every digit is on each row, column and box. used
+	// has bit n-1 set when n is there at least once and dup when it is
+	// there more than once, players can enter duplicates unlike the
+	// engine's grids.
+	uint8_t counts[SUDOKU_UNITS_COUNT][9][9];
+	uint16_t used[SUDOKU_UNITS_COUNT][9];
+	uint16_t dup[SUDOKU_UNITS_COUNT][9];
+
+	int filled;
+	int conflicts;
+	// show the candidates instead of the pencil marks, toggled with c.
+	bool auto_marks;
+
+	// Width of every digit at the sizes used for values and pencil
+	// marks, only measured again when the board is scaled.
+	struct {
+		float scale;
+		double value[9];
+		double mark[9];
+	} ext;
+
+	// the difficulty that was asked for, d cycles through them, and the
+	// one the puzzle was graded at which may be easier.
+	enum SudokuDifficulty difficulty;
+	enum SudokuDifficulty grade;
+	// state->sudoku_pool, which outlives the game.
+	struct SudokuPool *pool;
 };
 
 #define PONG_WIDTH 600
@@ -116,6 +186,15 @@ struct Sudoku {
 #define PONG_PLAYER_DY 200
 
 struct Pong {
+	// Where everything was before the last update, and where it was
+	// drawn last, draws happen in between.
+	struct {
+		struct FVec2 ball;
+		float player1_y;
+		float player2_y;
+	} prev, drawn;
+	int drawn_score;
+
 	float player1_y;
 	float player1_dy;
 
@@ -130,38 +209,39 @@ struct Pong {
 	struct FVec2 ball_velocity;
 };
 
-enum TetrisPiece {
-	// https://en.wikipedia.org/wiki/Tetromino#Free_tetrominoes
-	TPIECE_STRAIGHT,
-	TPIECE_SQUARE,
-	TPIECE_T,
-	TPIECE_L,
-	TPIECE_SKEW,
-	TPIECES_COUNT,
-};
-enum Rotation {
-	ROT_0,
-	ROT_90,
-	ROT_180,
-	ROT_270,
-	ROTS_COUNT,
-};
-
-#define TETRIS_HEIGHT 20
-#define TETRIS_WIDTH 10
-_Static_assert(TETRIS_WIDTH > 4, "TETRIS_WIDTH must be at least 4");
+#define TETRIS_FALL_INTERVAL 0.7
 
 struct Tetris {
 	//int score;
 	int board[TETRIS_HEIGHT][TETRIS_WIDTH];
+	// Bit x of rows[y] is set when board[y][x] is, collisions and full
+	// lines are only checked against these.
+	uint16_t rows[TETRIS_HEIGHT];
 	bool lost;
 
+	// Set when a piece lands: bit y of cleared for every removed line, and
+	// rows above dirty_rows are the only ones that changed.
+	uint32_t cleared;
+	int dirty_rows;
+
 	struct Vec2 curPos;
 	enum TetrisPiece curPiece;
 	enum Rotation rotation;
 
 	enum TetrisPiece nextPiece;
 	enum Rotation nextRotation;
+
+	double accum_time;
+	struct Rng rng;
+
+	// With autoplay on the bot picks a move once for every new piece,
+	// counted by pieces, and presses the keys to get there. It's only
+	// created once it's needed.
+	struct TetrisBot *bot;
+	bool autoplay;
+	int pieces;
+	int planned;
+	struct TetrisMove plan;
 };
 
 #define CAR_TRACK_SIZE 64
@@ -174,6 +254,10 @@ struct FLine {
 };
 
 struct CarRace {
+	// the car before the last update, for drawing in between.
+	struct FVec2 prevPos;
+	float prevAngle;
+
 	struct FVec2 carPos;
 	float velocity;
 	float accel;
@@ -211,6 +295,13 @@ struct CarRace {
 #define BREAKOUT_PLAYER_Y (BREAKOUT_HEIGHT * 0.9)
 
 struct Breakout {
+	// Paddle and ball before the last update, and where they were drawn
+	// last, draws happen in between.
+	struct {
+		float x_pos;
+		struct FVec2 ball_pos;
+	} prev, drawn;
+
 	float x_pos;
 	bool bars_destroyed[BREAKOUT_BARS_ROWS][BREAKOUT_BARS_COLS];
 
@@ -220,16 +311,26 @@ struct Breakout {
 	bool move_ball;
 };
 
+// The swap chain never holds more than this many buffers, 2 is enough while
+// the compositor keeps up and the third one lets us draw ahead when it
+// doesn't.
+#define MAX_BUFFERS 3
+
 struct Buffer {
 	struct wl_buffer *wl_buf;
 	int width;
 	int height;
 	int stride;
-	int fd;
+	// where data starts in the shm pool.
+	size_t offset;
 	uint8_t *data;
 	size_t data_sz;
 	cairo_t *cr;
 	cairo_surface_t *surf;
+
+	// set when the buffer is attached and cleared once the compositor
+	// sends wl_buffer.release, we must not draw into it in between.
+	bool busy;
 };
 
 struct Pointer {
@@ -242,26 +343,53 @@ struct Pointer {
 	struct wl_cursor_image *image;
 	struct wl_pointer *pointer;
 	uint32_t serial;
+	// a frame callback is pending on the cursor surface.
+	bool animating;
 };
 
-#define MAX_INPUT_KEYS 256
-enum KeyState {
-	KEY_PRESSED,
-	KEY_REPEAT,
-	KEY_RELEASED,
-};
-
-struct Input {
-	struct {
-		xkb_keysym_t keysym;
-		enum KeyState state;
-	} keys[MAX_INPUT_KEYS];
-	size_t keys_len;
+#define MAX_DAMAGE_RECTS 16
+
+// The synthetic frame rate used when running without a compositor.
+#define HEADLESS_RATE 60
+
+// The performance overlay keeps this many frames, each one is a pixel wide
+// column in its graph.
+#define HUD_FRAMES 240
+#define HUD_TEXT_HEIGHT 57
+#define HUD_GRAPH_HEIGHT 48
+// how often the numbers are recomputed and the text redrawn, in seconds.
+#define HUD_TEXT_INTERVAL 0.25
+// frames taking longer than this are drawn in red.
+#define HUD_BUDGET (1.0 / 60)
+
+struct Hud {
+	bool visible;
+
+	// ring buffer of when each frame started and how long it took to
+	// draw, in seconds.
+	double start[HUD_FRAMES];
+	double work[HUD_FRAMES];
+	int head;
+	int len;
+
+	// copied from the wayland thread at the start of every frame.
+	int buffer_allocs;
+	size_t pool_size;
+	// from a key to the frame callback of the first frame showing it, in
+	// seconds, the callback comes once that frame is on screen.
+	double input_latency;
+
+	// The text is rendered into its own surface a few times a second and
+	// just composited in between.
+	cairo_surface_t *text_surf;
+	double text_time;
+	double sorted[HUD_FRAMES];
 };
 
 struct State {
 	struct wl_display *display;
 	struct wl_shm *shm;
+	struct ShmPool *pool;
 	struct wl_compositor *compositor;
 	struct wl_surface *surface;
 	struct wl_registry *registry;
@@ -285,12 +413,35 @@ struct State {
 	struct {
 		int fd;
 		xkb_keysym_t keysym;
+		// when the key was pressed, repeats are timed from it.
+		double time;
+		uint32_t msec;
 	} repeat_key;
 
+	// Fires at deadline while the render thread is idle, so games that move
+	// on their own are woken up by the kernel. at is what it's armed for,
+	// negative when it isn't.
+	struct {
+		int fd;
+		double at;
+	} game_timer;
+
 	int width;
 	int height;
 
-	struct Buffer buffer;
+	struct Buffer buffers[MAX_BUFFERS];
+	// the slot being drawn to this frame.
+	struct Buffer *buffer;
+
+	// Parts of the buffer that changed since the last frame that was
+	// shown. Games that don't report anything get the whole buffer
+	// damaged when they redraw.
+	struct {
+		struct Rect rects[MAX_DAMAGE_RECTS];
+		int len;
+		// the whole buffer changed, rects are ignored.
+		bool all;
+	} damage;
 
 	struct {
 		int selected;
@@ -300,7 +451,26 @@ struct State {
 		int cols;
 	} sel_scr;
 
+	// Games split their own generator off this one when they start, it
+	// is seeded once so a run can be reproduced.
+	struct Rng rng;
+
+	// snake's board size, can be set from the command line.
+	int snake_cols;
+	int snake_rows;
+	// tetris starts with the bot playing, which searches on this many
+	// threads.
+	bool autoplay;
+	int threads;
+	// Sudoku puzzles generated on another thread ahead of time. It runs
+	// from the start of the program and its code is in the main binary,
+	// not in a libgames.so that F5 may unload.
+	struct SudokuPool *sudoku_pool;
+
 	int cur_game;
+	// Time that passed but hasn't been simulated yet, less than TICK_DT
+	// after every frame.
+	double tick_accum;
 	union {
 		struct Snake snake;
 		struct Sudoku sudoku;
@@ -310,21 +480,91 @@ struct State {
 		struct Breakout breakout;
 	};
 
+	// NULL unless a trace was requested. prof is used by whichever thread
+	// runs the games, wl_prof by the wayland thread while there's a render
+	// thread.
+	struct Profiler *prof;
+	struct Profiler *wl_prof;
+	// NULL unless the input is being recorded.
+	struct Replay *record;
+	struct Hud hud;
+
 	bool configured;
 	bool redraw;
 	bool quit;
 
+	// a frame callback has been requested and hasn't fired yet.
+	bool frame_pending;
+	// compositor time of the oldest key shown by the frame waiting on the
+	// callback, zero if there is none.
+	uint32_t pending_msec;
+	// CLOCK_MONOTONIC time in seconds at which the current game wants to
+	// be updated again, negative if it only needs input.
+	double deadline;
+
+	// The wayland thread dispatches events and commits buffers, the render
+	// thread updates and draws the games into them. Everything in here
+	// but input is guarded by lock, input is a ring that the wayland
+	// thread pushes keys into without taking it.
+	struct {
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		// the render thread writes to it when a frame is done.
+		int wake_fd;
+		// tells the render thread to stop.
+		bool exit;
+
+		// Keys from the wayland thread, the render thread takes them
+		// off at the start of every frame.
+		struct InputRing input;
+
+		// Requests that came in since the last frame started.
+		bool configured;
+		bool redraw;
+		int buffer_allocs;
+		double input_latency;
+
+		// The buffer the next frame is drawn into, NULL while the render
+		// thread has nothing to do. It stays set once the frame is done
+		// until the wayland thread commits it.
+		struct Buffer *target;
+		bool done;
+		// the finished frame changed something and should be shown.
+		bool show;
+		// compositor time of the oldest key the finished frame used,
+		// zero if none.
+		uint32_t input_msec;
+		// q was pressed in the menu.
+		bool quit;
+	} render;
+
 	struct Color fg;
 	struct Color bg;
 	struct Color colors[COLORS_COUNT];
 };
 
+// nextTick returns the number of seconds until the game needs to be updated
+// again, or one of these.
+#define TICK_NOW 0.0
+#define TICK_IDLE -1.0
+
+// Games are simulated in steps of TICK_DT, however often they're drawn.
+#define TICK_RATE 60
+#define TICK_DT (1.0 / TICK_RATE)
+
 struct GameInterface {
 	char *name;
-	void (*updateDraw)(struct State *state, struct Input input, double dt);
+	// Advances the game by TICK_DT, input has the keys that came in since
+	// the last update.
+	void (*update)(struct State *state, const struct Input *input);
+	// Draws the game if state->redraw is set, alpha goes from 0 to 1
+	// between the previous update and the next one.
+	void (*draw)(struct State *state, double alpha);
 	void (*init)(struct State *state);
 	void (*fini)(struct State *state);
 	void (*preview)(struct State *state, int x, int y, int size);
+	double (*nextTick)(struct State *state);
 };
 
 enum {
@@ -0,0 +1,209 @@
+/*
+ * A tiny profiler that writes Chrome's trace event format, the output can be
+ * loaded in chrome://tracing or https://ui.perfetto.dev.
+ *
+ * Everything is static inline so both main.c and games.c (which may be a
+ * separately loaded libgames.so) can record into the same struct Profiler.
+ * Events are kept in a fixed array and written out whenever it fills up, so
+ * recording never allocates.
+ *
+ * A Profiler belongs to one thread, other threads get their own from
+ * prof_create_thread. They write to the same file under its lock, each with
+ * its own tid, so every thread gets a track of its own.
+ */
+
+#ifndef PROF_H
+#define PROF_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PROF_MAX_EVENTS 4096
+#define PROF_MAX_DEPTH 32
+#define PROF_MAX_NAME 32
+
+struct ProfEvent {
+	// a copy, the caller's string may be in a libgames.so that is
+	// reloaded before the event is written out.
+	char name[PROF_MAX_NAME];
+	double start; // microseconds
+	double end;
+};
+
+// Shared by all the profilers writing to one trace.
+struct ProfFile {
+	pthread_mutex_t lock;
+	FILE *f;
+	bool first;
+	// the last tid handed out.
+	int tids;
+	// profilers still writing, the last one to go closes the file.
+	int refs;
+};
+
+struct Profiler {
+	struct ProfFile *file;
+	int tid;
+
+	struct ProfEvent events[PROF_MAX_EVENTS];
+	int len;
+
+	// events that have begun, but not ended yet.
+	struct ProfEvent stack[PROF_MAX_DEPTH];
+	int depth;
+};
+
+// Both expect state->prof to be NULL when profiling is disabled.
+#define PROF_BEGIN(state, name) PROF_BEGIN_ON((state)->prof, (name))
+#define PROF_END(state) PROF_END_ON((state)->prof)
+
+// For threads other than the one state->prof belongs to.
+#define PROF_BEGIN_ON(prof, name) \
+do { \
+	if (prof) prof_begin((prof), (name)); \
+} while (0)
+
+#define PROF_END_ON(prof) \
+do { \
+	if (prof) prof_end((prof)); \
+} while (0)
+
+static inline double
+prof_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+// Called with file->lock held.
+static inline void
+prof_write(struct ProfFile *file, const char *event)
+{
+	fprintf(file->f, "%s\n%s", file->first ? "" : ",", event);
+	file->first = false;
+}
+
+static inline void
+prof_flush(struct Profiler *p)
+{
+	struct ProfFile *file = p->file;
+	pthread_mutex_lock(&file->lock);
+	for (int i = 0; i < p->len; i++) {
+		struct ProfEvent *e = &p->events[i];
+		char event[256];
+		snprintf(event, sizeof(event),
+				"{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}",
+				e->name, e->start, e->end - e->start, p->tid);
+		prof_write(file, event);
+	}
+	pthread_mutex_unlock(&file->lock);
+	p->len = 0;
+}
+
+static inline void
+prof_begin(struct Profiler *p, const char *name)
+{
+	if (p->depth >= PROF_MAX_DEPTH)
+		return;
+	strncpy(p->stack[p->depth].name, name, PROF_MAX_NAME - 1);
+	p->stack[p->depth].start = prof_now();
+	p->depth++;
+}
+
+static inline void
+prof_end(struct Profiler *p)
+{
+	if (p->depth <= 0)
+		return;
+	p->depth--;
+	if (p->len >= PROF_MAX_EVENTS)
+		prof_flush(p);
+	p->events[p->len] = p->stack[p->depth];
+	p->events[p->len].end = prof_now();
+	p->len++;
+}
+
+static inline struct Profiler *
+prof_join(struct ProfFile *file, const char *name)
+{
+	struct Profiler *p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return NULL;
+	p->file = file;
+
+	pthread_mutex_lock(&file->lock);
+	p->tid = ++file->tids;
+	file->refs++;
+	char event[256];
+	snprintf(event, sizeof(event),
+			"{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+			p->tid, name);
+	prof_write(file, event);
+	pthread_mutex_unlock(&file->lock);
+	return p;
+}
+
+// The profiler of the thread called name, writing a new trace to path.
+static inline struct Profiler *
+prof_create(const char *path, const char *name)
+{
+	struct ProfFile *file = calloc(1, sizeof(*file));
+	if (file == NULL)
+		return NULL;
+	file->f = fopen(path, "w");
+	if (file->f == NULL) {
+		perror(path);
+		free(file);
+		return NULL;
+	}
+	pthread_mutex_init(&file->lock, NULL);
+	file->first = true;
+	fprintf(file->f, "{\"traceEvents\":[");
+
+	struct Profiler *p = prof_join(file, name);
+	if (p == NULL) {
+		fclose(file->f);
+		pthread_mutex_destroy(&file->lock);
+		free(file);
+	}
+	return p;
+}
+
+// A profiler for another thread, called name, writing to the same trace as
+// p. NULL if p is.
+static inline struct Profiler *
+prof_create_thread(struct Profiler *p, const char *name)
+{
+	if (p == NULL)
+		return NULL;
+	return prof_join(p->file, name);
+}
+
+static inline void
+prof_destroy(struct Profiler *p)
+{
+	if (p == NULL)
+		return;
+	while (p->depth > 0)
+		prof_end(p);
+	prof_flush(p);
+
+	struct ProfFile *file = p->file;
+	free(p);
+	pthread_mutex_lock(&file->lock);
+	bool last = --file->refs == 0;
+	pthread_mutex_unlock(&file->lock);
+	if (!last)
+		return;
+	fprintf(file->f, "\n]}\n");
+	fclose(file->f);
+	pthread_mutex_destroy(&file->lock);
+	free(file);
+}
+
+#endif
@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "replay.h"
+
+struct Replay *
+replay_create(char *path, uint32_t seed)
+{
+	struct Replay *r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+
+	r->f = fopen(path, "wb");
+	if (r->f == NULL) {
+		perror(path);
+		free(r);
+		return NULL;
+	}
+	r->path = path;
+	r->writing = true;
+	memcpy(r->header.magic, REPLAY_MAGIC, sizeof(r->header.magic));
+	r->header.version = REPLAY_VERSION;
+	r->header.seed = seed;
+	return r;
+}
+
+struct Replay *
+replay_open(char *path)
+{
+	struct Replay *r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+
+	r->f = fopen(path, "rb");
+	if (r->f == NULL) {
+		perror(path);
+		free(r);
+		return NULL;
+	}
+	r->path = path;
+
+	if (fread(&r->header, sizeof(r->header), 1, r->f) != 1 ||
+			memcmp(r->header.magic, REPLAY_MAGIC, sizeof(r->header.magic)) != 0) {
+		fprintf(stderr, "%s: not a replay file\n", path);
+		goto err;
+	}
+	if (r->header.version != REPLAY_VERSION) {
+		fprintf(stderr, "%s: unsupported replay version %u\n", path,
+				r->header.version);
+		goto err;
+	}
+	if (r->header.width <= 0 || r->header.height <= 0) {
+		fprintf(stderr, "%s: invalid size %dx%d\n", path,
+				r->header.width, r->header.height);
+		goto err;
+	}
+	r->header_written = true;
+	return r;
+
+err:
+	fclose(r->f);
+	free(r);
+	return NULL;
+}
+
+void
+replay_write_frame(struct Replay *r, int width, int height,
+		struct ReplayFrame *frame)
+{
+	if (!r->header_written) {
+		r->header.width = width;
+		r->header.height = height;
+		r->header.game = frame->game;
+		if (fwrite(&r->header, sizeof(r->header), 1, r->f) != 1)
+			goto err;
+		r->header_written = true;
+	}
+
+	if (fwrite(&frame->dt, sizeof(frame->dt), 1, r->f) != 1 ||
+			fwrite(&frame->game, sizeof(frame->game), 1, r->f) != 1 ||
+			fwrite(&frame->keys_len, sizeof(frame->keys_len), 1, r->f) != 1)
+		goto err;
+	if (frame->keys_len > 0 && fwrite(frame->keys, sizeof(*frame->keys),
+				frame->keys_len, r->f) != frame->keys_len)
+		goto err;
+	return;
+
+err:
+	perror(r->path);
+	exit(1);
+}
+
+// Returns false at the end of the log.
+bool
+replay_read_frame(struct Replay *r, struct ReplayFrame *frame)
+{
+	if (fread(&frame->dt, sizeof(frame->dt), 1, r->f) != 1)
+		return false;
+	if (fread(&frame->game, sizeof(frame->game), 1, r->f) != 1 ||
+			fread(&frame->keys_len, sizeof(frame->keys_len), 1, r->f) != 1 ||
+			frame->keys_len > REPLAY_MAX_KEYS ||
+			fread(frame->keys, sizeof(*frame->keys), frame->keys_len,
+				r->f) != frame->keys_len) {
+		fprintf(stderr, "%s: truncated replay\n", r->path);
+		return false;
+	}
+	return true;
+}
+
+void
+replay_close(struct Replay *r)
+{
+	if (r == NULL)
+		return;
+	if (fclose(r->f) != 0 && r->writing)
+		perror(r->path);
+	free(r);
+}
@@ -0,0 +1,57 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// An input log that lets a session be played again without a compositor.
+// Everything is written in native byte order:
+//
+//   header: "WLGR", version, seed, width, height, game, snake cols, rows
+//   frame:  double dt, int32 game, uint32 count, count * {keysym, state}
+//
+// The game is recorded per frame because leaving a game with q or Escape
+// never shows up in struct Input.
+
+#define REPLAY_MAGIC "WLGR"
+#define REPLAY_VERSION 2
+#define REPLAY_MAX_KEYS 256
+
+struct ReplayHeader {
+	char magic[4];
+	uint32_t version;
+	uint32_t seed;
+	int32_t width;
+	int32_t height;
+	int32_t game;
+	// options the games were started with.
+	int32_t snake_cols;
+	int32_t snake_rows;
+};
+
+struct ReplayKey {
+	uint32_t keysym;
+	uint32_t state;
+};
+
+struct ReplayFrame {
+	double dt;
+	int32_t game;
+	uint32_t keys_len;
+	struct ReplayKey keys[REPLAY_MAX_KEYS];
+};
+
+struct Replay {
+	FILE *f;
+	char *path;
+	bool writing;
+	// the header is only written along with the first frame, once the
+	// compositor has told us how big the window is.
+	bool header_written;
+	struct ReplayHeader header;
+};
+
+struct Replay *replay_create(char *path, uint32_t seed);
+struct Replay *replay_open(char *path);
+void replay_write_frame(struct Replay *r, int width, int height,
+		struct ReplayFrame *frame);
+bool replay_read_frame(struct Replay *r, struct ReplayFrame *frame);
+void replay_close(struct Replay *r);
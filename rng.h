@@ -0,0 +1,70 @@
+/*
+ * PCG32 (https://www.pcg-random.org), a small and fast generator whose whole
+ * state fits in two integers. Every game keeps its own so runs can be
+ * reproduced from a single seed and generators can be used from other
+ * threads without sharing libc's rand() state.
+ *
+ * Static inline so libgames.so doesn't need anything from main.c.
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+struct Rng {
+	uint64_t state;
+	uint64_t inc;
+};
+
+static inline uint32_t
+rng_next(struct Rng *r)
+{
+	uint64_t old = r->state;
+	r->state = old * 6364136223846793005ULL + r->inc;
+	uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+	uint32_t rot = old >> 59;
+	return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+// seq selects one of 2^63 independent streams.
+static inline void
+rng_seed(struct Rng *r, uint64_t seed, uint64_t seq)
+{
+	r->state = 0;
+	r->inc = (seq << 1) | 1;
+	rng_next(r);
+	r->state += seed;
+	rng_next(r);
+}
+
+// A new generator seeded from r, used to give each game its own stream.
+static inline struct Rng
+rng_split(struct Rng *r)
+{
+	// separate statements, the order of the calls decides the stream.
+	struct Rng child;
+	uint64_t hi = rng_next(r);
+	uint64_t lo = rng_next(r);
+	uint64_t seed = hi << 32 | lo;
+	hi = rng_next(r);
+	lo = rng_next(r);
+	uint64_t seq = hi << 32 | lo;
+	rng_seed(&child, seed, seq);
+	return child;
+}
+
+// Uniformly distributed in [0, n), n must be greater than 0.
+static inline uint32_t
+rng_range(struct Rng *r, uint32_t n)
+{
+	// values below threshold would make the lower results more likely.
+	uint32_t threshold = -n % n;
+	for (;;) {
+		uint32_t x = rng_next(r);
+		if (x >= threshold)
+			return x % n;
+	}
+}
+
+#endif
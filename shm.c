@@ -1,8 +1,14 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 #include <time.h>
 #include <unistd.h>
+#include <wayland-client.h>
+
+#include "shm.h"
 
 static void
 randname(char *buf)
@@ -19,12 +25,20 @@ randname(char *buf)
 static int
 create_shm_file(void)
 {
+	int fd = memfd_create("wl_shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd >= 0) {
+		// The compositor maps this file too, make sure it can never
+		// shrink under it.
+		fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_SEAL);
+		return fd;
+	}
+
 	int retries = 100;
 	do {
 		char name[] = "/wl_shm-XXXXXX";
 		randname(name + sizeof(name) - 7);
 		--retries;
-		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
 		if (fd >= 0) {
 			shm_unlink(name);
 			return fd;
@@ -33,20 +47,139 @@ create_shm_file(void)
 	return -1;
 }
 
+static int
+resize_shm_file(int fd, size_t size)
+{
+	int ret;
+	do {
+		ret = ftruncate(fd, size);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
 int
 allocate_shm_file(size_t size)
 {
 	int fd = create_shm_file();
 	if (fd < 0)
 		return -1;
-	int ret;
-	do {
-		ret = ftruncate(fd, size);
-	} while (ret < 0 && errno == EINTR);
-	if (ret < 0) {
+	if (resize_shm_file(fd, size) < 0) {
 		close(fd);
 		return -1;
 	}
 	return fd;
 }
 
+static size_t
+page_align(size_t size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	return (size + page - 1) / page * page;
+}
+
+struct ShmPool *
+shm_pool_create(struct wl_shm *shm, size_t size)
+{
+	struct ShmPool *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->size = page_align(size);
+	pool->fd = allocate_shm_file(pool->size);
+	if (pool->fd < 0) {
+		free(pool);
+		return NULL;
+	}
+
+	// Map the whole reservation now, only the part backed by the file
+	// is ever touched.
+	pool->data = mmap(NULL, SHM_POOL_RESERVE, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_NORESERVE, pool->fd, 0);
+	if (pool->data == MAP_FAILED) {
+		perror("mmap");
+		close(pool->fd);
+		free(pool);
+		return NULL;
+	}
+
+	pool->pool = wl_shm_create_pool(shm, pool->fd, pool->size);
+	if (pool->pool == NULL) {
+		munmap(pool->data, SHM_POOL_RESERVE);
+		close(pool->fd);
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void
+shm_pool_destroy(struct ShmPool *pool)
+{
+	if (pool == NULL)
+		return;
+	wl_shm_pool_destroy(pool->pool);
+	munmap(pool->data, SHM_POOL_RESERVE);
+	close(pool->fd);
+	free(pool);
+}
+
+static bool
+shm_pool_grow(struct ShmPool *pool, size_t size)
+{
+	size_t new_size = pool->size * 2;
+	if (new_size < size)
+		new_size = size;
+	new_size = page_align(new_size);
+	if (new_size > SHM_POOL_RESERVE)
+		new_size = SHM_POOL_RESERVE;
+	if (new_size < size)
+		return false;
+
+	if (resize_shm_file(pool->fd, new_size) < 0) {
+		perror("ftruncate");
+		return false;
+	}
+	wl_shm_pool_resize(pool->pool, new_size);
+	pool->size = new_size;
+	return true;
+}
+
+// First fit allocation, the pool is grown if there's no gap large enough.
+bool
+shm_pool_alloc(struct ShmPool *pool, size_t size, size_t *offset)
+{
+	if (pool->used_len >= SHM_POOL_MAX_ALLOCS)
+		return false;
+
+	size_t start = 0;
+	int i;
+	for (i = 0; i < pool->used_len; i++) {
+		if (start + size <= pool->used[i].offset)
+			break;
+		start = pool->used[i].offset + pool->used[i].size;
+	}
+	if (start + size > pool->size && !shm_pool_grow(pool, start + size))
+		return false;
+
+	for (int j = pool->used_len; j > i; j--)
+		pool->used[j] = pool->used[j-1];
+	pool->used[i].offset = start;
+	pool->used[i].size = size;
+	pool->used_len++;
+
+	*offset = start;
+	return true;
+}
+
+void
+shm_pool_free(struct ShmPool *pool, size_t offset)
+{
+	for (int i = 0; i < pool->used_len; i++) {
+		if (pool->used[i].offset != offset)
+			continue;
+		for (int j = i; j < pool->used_len - 1; j++)
+			pool->used[j] = pool->used[j+1];
+		pool->used_len--;
+		return;
+	}
+}
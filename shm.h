@@ -1 +1,31 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 int allocate_shm_file(size_t size);
+
+// Address space reserved for a pool up front, so growing the pool never moves
+// the mapping and pointers into it stay valid.
+#define SHM_POOL_RESERVE (1 << 30)
+#define SHM_POOL_MAX_ALLOCS 8
+
+// A single shm file shared with the compositor that buffers are carved out
+// of. It only ever grows, which is all wl_shm_pool_resize allows.
+struct ShmPool {
+	struct wl_shm_pool *pool;
+	int fd;
+	uint8_t *data;
+	size_t size;
+
+	// allocated ranges sorted by offset.
+	struct {
+		size_t offset;
+		size_t size;
+	} used[SHM_POOL_MAX_ALLOCS];
+	int used_len;
+};
+
+struct ShmPool *shm_pool_create(struct wl_shm *shm, size_t size);
+void shm_pool_destroy(struct ShmPool *pool);
+bool shm_pool_alloc(struct ShmPool *pool, size_t size, size_t *offset);
+void shm_pool_free(struct ShmPool *pool, size_t offset);
@@ -0,0 +1,555 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rng.h"
+#include "sudoku.h"
+
+void
+sudoku_grid_clear(struct SudokuGrid *g)
+{
+	memset(g, 0, sizeof(*g));
+}
+
+bool
+sudoku_grid_load(struct SudokuGrid *g, const uint8_t cells[81])
+{
+	sudoku_grid_clear(g);
+	for (int i = 0; i < 81; i++) {
+		int n = cells[i];
+		if (n == 0)
+			continue;
+		if (n > 9 || !(sudoku_grid_candidates(g, i) & SUDOKU_BIT(n)))
+			return false;
+		sudoku_grid_set(g, i, n);
+	}
+	return true;
+}
+
+// Cells of every unit, 0-8 are rows, 9-17 columns and 18-26 boxes.
+static const uint8_t units[27][9] = {
+	{ 0,  1,  2,  3,  4,  5,  6,  7,  8},
+	{ 9, 10, 11, 12, 13, 14, 15, 16, 17},
+	{18, 19, 20, 21, 22, 23, 24, 25, 26},
+	{27, 28, 29, 30, 31, 32, 33, 34, 35},
+	{36, 37, 38, 39, 40, 41, 42, 43, 44},
+	{45, 46, 47, 48, 49, 50, 51, 52, 53},
+	{54, 55, 56, 57, 58, 59, 60, 61, 62},
+	{63, 64, 65, 66, 67, 68, 69, 70, 71},
+	{72, 73, 74, 75, 76, 77, 78, 79, 80},
+	{ 0,  9, 18, 27, 36, 45, 54, 63, 72},
+	{ 1, 10, 19, 28, 37, 46, 55, 64, 73},
+	{ 2, 11, 20, 29, 38, 47, 56, 65, 74},
+	{ 3, 12, 21, 30, 39, 48, 57, 66, 75},
+	{ 4, 13, 22, 31, 40, 49, 58, 67, 76},
+	{ 5, 14, 23, 32, 41, 50, 59, 68, 77},
+	{ 6, 15, 24, 33, 42, 51, 60, 69, 78},
+	{ 7, 16, 25, 34, 43, 52, 61, 70, 79},
+	{ 8, 17, 26, 35, 44, 53, 62, 71, 80},
+	{ 0,  1,  2,  9, 10, 11, 18, 19, 20},
+	{ 3,  4,  5, 12, 13, 14, 21, 22, 23},
+	{ 6,  7,  8, 15, 16, 17, 24, 25, 26},
+	{27, 28, 29, 36, 37, 38, 45, 46, 47},
+	{30, 31, 32, 39, 40, 41, 48, 49, 50},
+	{33, 34, 35, 42, 43, 44, 51, 52, 53},
+	{54, 55, 56, 63, 64, 65, 72, 73, 74},
+	{57, 58, 59, 66, 67, 68, 75, 76, 77},
+	{60, 61, 62, 69, 70, 71, 78, 79, 80},
+};
+
+// __builtin_popcount is a library call unless the target has an
+// instruction for it, masks only have 9 bits so a nibble table is enough.
+static inline int
+count_digits(uint16_t mask)
+{
+	static const uint8_t nibble[16] = {0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4};
+	return nibble[mask & 0xf] + nibble[(mask >> 4) & 0xf] + (mask >> 8);
+}
+
+// Searches for up to limit solutions and copies the first one found to
+// solution if it isn't NULL. Besides the cell with the fewest candidates it
+// looks for digits that fit in only one place of a row, column or box,
+// which cuts the search down a lot on hard puzzles.
+static int
+search(struct SudokuGrid *g, int limit, struct SudokuGrid *solution)
+{
+	uint16_t cand[81];
+	int best = -1;
+	int best_count = 10;
+	for (int i = 0; i < 81; i++) {
+		if (g->cells[i] != 0) {
+			cand[i] = 0;
+			continue;
+		}
+		cand[i] = sudoku_grid_candidates(g, i);
+		int count = count_digits(cand[i]);
+		if (count == 0)
+			return 0;
+		if (count < best_count) {
+			best = i;
+			best_count = count;
+		}
+	}
+	if (best < 0) {
+		if (solution)
+			*solution = *g;
+		return 1;
+	}
+
+	if (best_count > 1) {
+		for (int u = 0; u < 27; u++) {
+			uint16_t used = u < 9 ? g->rows[u] :
+				u < 18 ? g->cols[u - 9] : g->boxes[u - 18];
+			uint16_t once = 0, twice = 0;
+			for (int j = 0; j < 9; j++) {
+				uint16_t c = cand[units[u][j]];
+				twice |= once & c;
+				once |= c;
+			}
+			uint16_t missing = ~used & SUDOKU_DIGITS;
+			if (missing & ~once)
+				return 0;
+			uint16_t hidden = missing & once & ~twice;
+			if (hidden == 0)
+				continue;
+
+			uint16_t bit = hidden & -hidden;
+			for (int j = 0; j < 9; j++) {
+				int i = units[u][j];
+				if (cand[i] & bit) {
+					sudoku_grid_set(g, i, __builtin_ctz(bit) + 1);
+					int count = search(g, limit, solution);
+					sudoku_grid_unset(g, i);
+					return count;
+				}
+			}
+		}
+	}
+
+	uint16_t candidates = cand[best];
+	int count = 0;
+	while (candidates && count < limit) {
+		int n = __builtin_ctz(candidates) + 1;
+		candidates &= candidates - 1;
+		sudoku_grid_set(g, best, n);
+		count += search(g, limit - count, count == 0 ? solution : NULL);
+		sudoku_grid_unset(g, best);
+	}
+	return count;
+}
+
+// Number of solutions, but stops looking once limit is reached. The first
+// one is copied to solution if it isn't NULL, g is left as it was.
+int
+sudoku_grid_solve(struct SudokuGrid *g, int limit, struct SudokuGrid *solution)
+{
+	return search(g, limit, solution);
+}
+
+// A random complete grid. The three boxes on the diagonal don't constrain
+// each other, so they are shuffled first and the rest is solved from there.
+void
+sudoku_grid_random(struct SudokuGrid *g, struct Rng *rng)
+{
+	sudoku_grid_clear(g);
+	for (int box = 0; box < 9; box += 4) {
+		uint8_t digits[9] = {1, 2, 3, 4, 5, 6, 7, 8, 9};
+		for (int i = 8; i > 0; i--) {
+			int j = rng_range(rng, i + 1);
+			uint8_t t = digits[i];
+			digits[i] = digits[j];
+			digits[j] = t;
+		}
+		for (int i = 0; i < 9; i++) {
+			int x = box % 3 * 3 + i % 3;
+			int y = box / 3 * 3 + i / 3;
+			sudoku_grid_set(g, y * 9 + x, digits[i]);
+		}
+	}
+
+	struct SudokuGrid solution;
+	if (sudoku_grid_solve(g, 1, &solution) != 1) {
+		assert(0 && "unreachable");
+	}
+	*g = solution;
+}
+
+// Whether g, which has a single solution with n in cell i, still has only
+// that one once cell i is emptied. Only the other digits for the cell need
+// to be searched, and one solution is enough to say no.
+static bool
+unique_without(struct SudokuGrid *g, int i, int n)
+{
+	sudoku_grid_unset(g, i);
+	uint16_t others = sudoku_grid_candidates(g, i) & ~SUDOKU_BIT(n);
+	bool unique = true;
+	while (others && unique) {
+		int m = __builtin_ctz(others) + 1;
+		others &= others - 1;
+		sudoku_grid_set(g, i, m);
+		unique = search(g, 1, NULL) == 0;
+		sudoku_grid_unset(g, i);
+	}
+	sudoku_grid_set(g, i, n);
+	return unique;
+}
+
+struct Grader {
+	struct SudokuGrid g;
+	uint16_t cand[81];
+};
+
+static void
+grader_place(struct Grader *gr, int i, int n)
+{
+	sudoku_grid_set(&gr->g, i, n);
+	gr->cand[i] = 0;
+	int x = i % 9, y = i / 9, box = SUDOKU_BOX(x, y);
+	for (int j = 0; j < 9; j++) {
+		gr->cand[units[y][j]] &= ~SUDOKU_BIT(n);
+		gr->cand[units[9 + x][j]] &= ~SUDOKU_BIT(n);
+		gr->cand[units[18 + box][j]] &= ~SUDOKU_BIT(n);
+	}
+}
+
+// Returns -1 on a contradiction, otherwise how many cells were placed.
+static int
+singles(struct Grader *gr)
+{
+	int placed = 0;
+	for (int i = 0; i < 81; i++) {
+		if (gr->g.cells[i] != 0)
+			continue;
+		uint16_t c = gr->cand[i];
+		if (c == 0)
+			return -1;
+		if ((c & (c - 1)) == 0) {
+			grader_place(gr, i, __builtin_ctz(c) + 1);
+			placed++;
+		}
+	}
+
+	for (int u = 0; u < 27; u++) {
+		// digits seen in at least one and in more than one cell.
+		uint16_t once = 0, twice = 0, filled = 0;
+		for (int j = 0; j < 9; j++) {
+			int i = units[u][j];
+			uint16_t c = gr->cand[i];
+			twice |= once & c;
+			once |= c;
+			if (gr->g.cells[i])
+				filled |= SUDOKU_BIT(gr->g.cells[i]);
+		}
+		if ((once | filled) != SUDOKU_DIGITS)
+			return -1;
+		uint16_t hidden = once & ~twice;
+		for (int j = 0; j < 9 && hidden; j++) {
+			int i = units[u][j];
+			uint16_t c = gr->cand[i] & hidden;
+			if (c == 0)
+				continue;
+			if (c & (c - 1))
+				return -1;
+			hidden &= ~c;
+			grader_place(gr, i, __builtin_ctz(c) + 1);
+			placed++;
+		}
+	}
+	return placed;
+}
+
+// A digit that can only go in one row or column of a box can't go anywhere
+// else in that row or column, and the other way around.
+static bool
+locked_candidates(struct Grader *gr)
+{
+	bool changed = false;
+	for (int box = 0; box < 9; box++) {
+		for (int line = 0; line < 18; line++) {
+			// cells shared by the box and the line, and the rest of
+			// each of them.
+			uint16_t inside = 0, box_rest = 0, line_rest = 0;
+			for (int j = 0; j < 9; j++) {
+				int i = units[18 + box][j];
+				int x = i % 9, y = i / 9;
+				bool on_line = line < 9 ? y == line : x == line - 9;
+				if (on_line)
+					inside |= gr->cand[i];
+				else
+					box_rest |= gr->cand[i];
+			}
+			if (inside == 0)
+				continue;
+			for (int j = 0; j < 9; j++) {
+				int i = units[line][j];
+				if (SUDOKU_BOX(i % 9, i / 9) != box)
+					line_rest |= gr->cand[i];
+			}
+
+			// pointing: confined to the line within the box.
+			uint16_t pointing = inside & ~box_rest & line_rest;
+			// claiming: confined to the box within the line.
+			uint16_t claiming = inside & ~line_rest & box_rest;
+			if (pointing) {
+				for (int j = 0; j < 9; j++) {
+					int i = units[line][j];
+					if (SUDOKU_BOX(i % 9, i / 9) != box)
+						gr->cand[i] &= ~pointing;
+				}
+				changed = true;
+			}
+			if (claiming) {
+				for (int j = 0; j < 9; j++) {
+					int i = units[18 + box][j];
+					int x = i % 9, y = i / 9;
+					bool on_line = line < 9 ? y == line : x == line - 9;
+					if (!on_line)
+						gr->cand[i] &= ~claiming;
+				}
+				changed = true;
+			}
+		}
+	}
+	return changed;
+}
+
+// Two cells in a unit with the same two candidates take those digits from
+// the rest of the unit.
+static bool
+naked_pairs(struct Grader *gr)
+{
+	bool changed = false;
+	for (int u = 0; u < 27; u++) {
+		for (int a = 0; a < 9; a++) {
+			uint16_t pair = gr->cand[units[u][a]];
+			if (count_digits(pair) != 2)
+				continue;
+			for (int b = a + 1; b < 9; b++) {
+				if (gr->cand[units[u][b]] != pair)
+					continue;
+				for (int j = 0; j < 9; j++) {
+					int i = units[u][j];
+					if (j == a || j == b || !(gr->cand[i] & pair))
+						continue;
+					gr->cand[i] &= ~pair;
+					changed = true;
+				}
+			}
+		}
+	}
+	return changed;
+}
+
+// Solves the puzzle the way a person would and returns the hardest
+// technique that was needed, SUDOKU_EXPERT if those aren't enough and
+// guessing is required.
+enum SudokuDifficulty
+sudoku_grid_grade(struct SudokuGrid *g)
+{
+	struct Grader gr = {0};
+	for (int i = 0; i < 81; i++) {
+		gr.cand[i] = g->cells[i] ? 0 : SUDOKU_DIGITS;
+	}
+	for (int i = 0; i < 81; i++) {
+		if (g->cells[i])
+			grader_place(&gr, i, g->cells[i]);
+	}
+
+	enum SudokuDifficulty level = SUDOKU_EASY;
+	for (;;) {
+		int placed = singles(&gr);
+		if (placed < 0)
+			return SUDOKU_EXPERT;
+		if (placed > 0)
+			continue;
+
+		bool solved = true;
+		for (int i = 0; i < 81; i++) {
+			if (gr.g.cells[i] == 0) {
+				solved = false;
+				break;
+			}
+		}
+		if (solved)
+			return level;
+
+		if (locked_candidates(&gr)) {
+			if (level < SUDOKU_MEDIUM)
+				level = SUDOKU_MEDIUM;
+		} else if (naked_pairs(&gr)) {
+			if (level < SUDOKU_HARD)
+				level = SUDOKU_HARD;
+		} else {
+			return SUDOKU_EXPERT;
+		}
+	}
+}
+
+// Takes clues away from a random solution for as long as the puzzle keeps a
+// single solution and doesn't get harder than difficulty. A few solutions
+// are tried and the hardest puzzle that doesn't go past difficulty is kept.
+enum SudokuDifficulty
+sudoku_generate(struct SudokuGrid *puzzle, struct SudokuGrid *solution,
+		enum SudokuDifficulty difficulty, struct Rng *rng)
+{
+	int best = -1;
+
+	for (int attempt = 0; attempt < SUDOKU_GEN_ATTEMPTS; attempt++) {
+		struct SudokuGrid full, g;
+		sudoku_grid_random(&full, rng);
+		g = full;
+
+		uint8_t order[81];
+		for (int i = 0; i < 81; i++) {
+			order[i] = i;
+		}
+		for (int i = 80; i > 0; i--) {
+			int j = rng_range(rng, i + 1);
+			uint8_t t = order[i];
+			order[i] = order[j];
+			order[j] = t;
+		}
+
+		for (int k = 0; k < 81; k++) {
+			int i = order[k];
+			int n = g.cells[i];
+			if (!unique_without(&g, i, n))
+				continue;
+			sudoku_grid_unset(&g, i);
+			if (difficulty < SUDOKU_EXPERT &&
+					sudoku_grid_grade(&g) > difficulty) {
+				sudoku_grid_set(&g, i, n);
+			}
+		}
+
+		enum SudokuDifficulty level = sudoku_grid_grade(&g);
+		if ((int)level > best) {
+			best = level;
+			*puzzle = g;
+			if (solution)
+				*solution = full;
+		}
+		if (level == difficulty)
+			break;
+	}
+	return best;
+}
+
+// The queue the worker should fill next, -1 if they are all full. Queues
+// somebody is waiting on come first, then the emptiest one.
+static int
+pool_next(struct SudokuPool *pool)
+{
+	int best = -1;
+	for (int d = 0; d < SUDOKU_DIFFICULTIES_COUNT; d++) {
+		if (pool->queues[d].len == SUDOKU_POOL_SIZE)
+			continue;
+		if (pool->queues[d].waiting > 0)
+			return d;
+		if (best < 0 || pool->queues[d].len < pool->queues[best].len)
+			best = d;
+	}
+	return best;
+}
+
+static void *
+pool_worker(void *data)
+{
+	struct SudokuPool *pool = data;
+
+	pthread_mutex_lock(&pool->lock);
+	for (;;) {
+		int d = -1;
+		while (!pool->quit && (d = pool_next(pool)) < 0) {
+			pthread_cond_wait(&pool->taken, &pool->lock);
+		}
+		if (pool->quit)
+			break;
+
+		// Only this thread uses the queue's generator, so the lock
+		// isn't needed while generating.
+		struct SudokuQueue *q = &pool->queues[d];
+		pthread_mutex_unlock(&pool->lock);
+		struct SudokuGrid puzzle;
+		enum SudokuDifficulty grade = sudoku_generate(&puzzle, NULL, d, &q->rng);
+		pthread_mutex_lock(&pool->lock);
+
+		int i = (q->head + q->len) % SUDOKU_POOL_SIZE;
+		q->puzzles[i] = puzzle;
+		q->grades[i] = grade;
+		q->len++;
+		pthread_cond_broadcast(&pool->ready);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct SudokuPool *
+sudoku_pool_create(struct Rng *rng)
+{
+	struct SudokuPool *pool = calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	for (int d = 0; d < SUDOKU_DIFFICULTIES_COUNT; d++) {
+		pool->queues[d].rng = rng_split(rng);
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->taken, NULL);
+	pthread_cond_init(&pool->ready, NULL);
+
+	int err = pthread_create(&pool->thread, NULL, pool_worker, pool);
+	if (err != 0) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		exit(1);
+	}
+	return pool;
+}
+
+void
+sudoku_pool_destroy(struct SudokuPool *pool)
+{
+	if (pool == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = true;
+	pthread_cond_signal(&pool->taken);
+	pthread_mutex_unlock(&pool->lock);
+	// at most one puzzle is being generated, which takes milliseconds.
+	pthread_join(pool->thread, NULL);
+
+	pthread_cond_destroy(&pool->ready);
+	pthread_cond_destroy(&pool->taken);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
+// Copies the oldest puzzle of a difficulty out of the pool and returns the
+// grade it got. This only waits for the worker if the queue ran dry, which
+// happens when the pool was just created.
+enum SudokuDifficulty
+sudoku_pool_take(struct SudokuPool *pool, enum SudokuDifficulty difficulty,
+		struct SudokuGrid *puzzle)
+{
+	pthread_mutex_lock(&pool->lock);
+	struct SudokuQueue *q = &pool->queues[difficulty];
+	q->waiting++;
+	while (q->len == 0) {
+		pthread_cond_signal(&pool->taken);
+		pthread_cond_wait(&pool->ready, &pool->lock);
+	}
+	q->waiting--;
+
+	*puzzle = q->puzzles[q->head];
+	enum SudokuDifficulty grade = q->grades[q->head];
+	q->head = (q->head + 1) % SUDOKU_POOL_SIZE;
+	q->len--;
+
+	pthread_cond_signal(&pool->taken);
+	pthread_mutex_unlock(&pool->lock);
+	return grade;
+}
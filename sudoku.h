@@ -0,0 +1,115 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "rng.h"
+
+// The sudoku engine shared by the game and the batch mode in
+// sudoku_batch.c, it works on bare grids and knows nothing about drawing.
+
+#define SUDOKU_DIGITS 0x1ff
+#define SUDOKU_BIT(n) ((uint16_t)1 << ((n) - 1))
+#define SUDOKU_BOX(x, y) ((y) / 3 * 3 + (x) / 3)
+
+// Cells are indexed y*9 + x, 0 marks an empty cell. The masks have bit n-1
+// set for every digit n used in that row, column or box, which only works
+// as long as the grid has no duplicates.
+struct SudokuGrid {
+	uint8_t cells[81];
+	uint16_t rows[9];
+	uint16_t cols[9];
+	uint16_t boxes[9];
+};
+
+// Digits that can go in cell i without breaking a rule.
+static inline uint16_t
+sudoku_grid_candidates(struct SudokuGrid *g, int i)
+{
+	int x = i % 9, y = i / 9;
+	return ~(g->rows[y] | g->cols[x] | g->boxes[SUDOKU_BOX(x, y)]) & SUDOKU_DIGITS;
+}
+
+// n must be one of the cell's candidates.
+static inline void
+sudoku_grid_set(struct SudokuGrid *g, int i, int n)
+{
+	int x = i % 9, y = i / 9;
+	uint16_t bit = SUDOKU_BIT(n);
+	g->cells[i] = n;
+	g->rows[y] |= bit;
+	g->cols[x] |= bit;
+	g->boxes[SUDOKU_BOX(x, y)] |= bit;
+}
+
+static inline void
+sudoku_grid_unset(struct SudokuGrid *g, int i)
+{
+	int x = i % 9, y = i / 9;
+	uint16_t bit = SUDOKU_BIT(g->cells[i]);
+	g->cells[i] = 0;
+	g->rows[y] &= ~bit;
+	g->cols[x] &= ~bit;
+	g->boxes[SUDOKU_BOX(x, y)] &= ~bit;
+}
+
+enum SudokuDifficulty {
+	// naked and hidden singles
+	SUDOKU_EASY,
+	// locked candidates
+	SUDOKU_MEDIUM,
+	// naked pairs
+	SUDOKU_HARD,
+	// needs guessing
+	SUDOKU_EXPERT,
+	SUDOKU_DIFFICULTIES_COUNT,
+};
+
+// how many solutions sudoku_generate tries to reach the difficulty.
+#define SUDOKU_GEN_ATTEMPTS 8
+
+void sudoku_grid_clear(struct SudokuGrid *g);
+// Loads 81 cells, returns false if they break a rule.
+bool sudoku_grid_load(struct SudokuGrid *g, const uint8_t cells[81]);
+int sudoku_grid_solve(struct SudokuGrid *g, int limit, struct SudokuGrid *solution);
+void sudoku_grid_random(struct SudokuGrid *g, struct Rng *rng);
+enum SudokuDifficulty sudoku_grid_grade(struct SudokuGrid *g);
+enum SudokuDifficulty sudoku_generate(struct SudokuGrid *puzzle,
+		struct SudokuGrid *solution, enum SudokuDifficulty difficulty,
+		struct Rng *rng);
+
+// Puzzles ready ahead of time for every difficulty.
+#define SUDOKU_POOL_SIZE 4
+
+struct SudokuQueue {
+	struct SudokuGrid puzzles[SUDOKU_POOL_SIZE];
+	enum SudokuDifficulty grades[SUDOKU_POOL_SIZE];
+	int head;
+	int len;
+	// Every difficulty has its own generator, so the puzzles handed out
+	// don't depend on the order the worker made them in.
+	struct Rng rng;
+	// threads blocked in sudoku_pool_take on this queue.
+	int waiting;
+};
+
+// A worker thread that keeps a few puzzles of every difficulty generated so
+// starting a new game doesn't have to wait for the generator.
+struct SudokuPool {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	// signals the worker that a puzzle was taken or it should quit,
+	// and waiters in sudoku_pool_take that a puzzle is ready.
+	pthread_cond_t taken;
+	pthread_cond_t ready;
+	bool quit;
+
+	struct SudokuQueue queues[SUDOKU_DIFFICULTIES_COUNT];
+};
+
+struct SudokuPool *sudoku_pool_create(struct Rng *rng);
+void sudoku_pool_destroy(struct SudokuPool *pool);
+enum SudokuDifficulty sudoku_pool_take(struct SudokuPool *pool,
+		enum SudokuDifficulty difficulty, struct SudokuGrid *puzzle);
+
+int sudoku_batch(const char *mode, const char *path, int threads, int count,
+		uint32_t seed);
@@ -0,0 +1,394 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rng.h"
+#include "sudoku.h"
+
+// Puzzles a worker takes at a time, small enough that threads finish close
+// together and large enough that they rarely touch the shared counter.
+#define BATCH_CHUNK 64
+// log2 buckets of the latency histogram, the first one is under 1us.
+#define BATCH_BUCKETS 24
+
+enum BatchMode {
+	BATCH_SOLVE,
+	BATCH_CHECK,
+	BATCH_GEN,
+};
+
+enum {
+	PUZZLE_INVALID = -1,
+	// otherwise the number of solutions found, up to 2.
+};
+
+struct Batch {
+	enum BatchMode mode;
+	int count;
+
+	// parsed input for solve and check, generated puzzles for gen.
+	struct SudokuGrid *puzzles;
+	struct SudokuGrid *solutions;
+	int *status;
+	double *times;
+
+	uint32_t seed;
+	enum SudokuDifficulty difficulty;
+
+	atomic_int next;
+};
+
+static double
+batch_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+xcalloc(size_t n, size_t size)
+{
+	void *p = calloc(n, size);
+	if (p == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	return p;
+}
+
+static void
+run_one(struct Batch *b, int i)
+{
+	double start = batch_now();
+	switch (b->mode) {
+	case BATCH_SOLVE:
+	case BATCH_CHECK:
+		if (b->status[i] == PUZZLE_INVALID)
+			return;
+		b->status[i] = sudoku_grid_solve(&b->puzzles[i], 2, &b->solutions[i]);
+		break;
+	case BATCH_GEN: {
+		// a stream per puzzle, so the output doesn't depend on which
+		// thread made it.
+		struct Rng rng;
+		rng_seed(&rng, b->seed, (uint64_t)b->difficulty << 32 | i);
+		b->status[i] = sudoku_generate(&b->puzzles[i], NULL,
+				b->difficulty, &rng);
+		break;
+	}
+	}
+	b->times[i] = batch_now() - start;
+}
+
+static void *
+batch_worker(void *data)
+{
+	struct Batch *b = data;
+	for (;;) {
+		int start = atomic_fetch_add(&b->next, BATCH_CHUNK);
+		if (start >= b->count)
+			break;
+		int end = start + BATCH_CHUNK;
+		if (end > b->count)
+			end = b->count;
+		for (int i = start; i < end; i++) {
+			run_one(b, i);
+		}
+	}
+	return NULL;
+}
+
+// Runs every puzzle of b on threads and returns the wall time.
+static double
+batch_run(struct Batch *b, int threads)
+{
+	pthread_t *tids = xcalloc(threads, sizeof(*tids));
+	atomic_store(&b->next, 0);
+
+	double start = batch_now();
+	// the calling thread is one of the workers.
+	for (int t = 1; t < threads; t++) {
+		int err = pthread_create(&tids[t], NULL, batch_worker, b);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	batch_worker(b);
+	for (int t = 1; t < threads; t++) {
+		pthread_join(tids[t], NULL);
+	}
+	double wall = batch_now() - start;
+
+	free(tids);
+	return wall;
+}
+
+static int
+compare_double(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void
+print_stats(struct Batch *b, const char *what, double wall, int threads)
+{
+	double *sorted = xcalloc(b->count, sizeof(*sorted));
+	int n = 0;
+	double total = 0;
+	for (int i = 0; i < b->count; i++) {
+		if (b->status[i] == PUZZLE_INVALID && b->mode != BATCH_GEN)
+			continue;
+		sorted[n++] = b->times[i];
+		total += b->times[i];
+	}
+	fprintf(stderr, "%s %d puzzles in %.3f s on %d threads, %.0f puzzles/s\n",
+			what, n, wall, threads, wall > 0 ? n / wall : 0);
+	if (n == 0) {
+		free(sorted);
+		return;
+	}
+	qsort(sorted, n, sizeof(*sorted), compare_double);
+	fprintf(stderr, "latency (us): min %.1f avg %.1f p50 %.1f p99 %.1f max %.1f\n",
+			sorted[0] * 1e6, total / n * 1e6,
+			sorted[(int)(0.5 * (n - 1) + 0.5)] * 1e6,
+			sorted[(int)(0.99 * (n - 1) + 0.5)] * 1e6,
+			sorted[n - 1] * 1e6);
+
+	int buckets[BATCH_BUCKETS] = {0};
+	int most = 0;
+	for (int i = 0; i < n; i++) {
+		double us = sorted[i] * 1e6;
+		int k = 0;
+		while (us >= 1 && k < BATCH_BUCKETS - 1) {
+			us /= 2;
+			k++;
+		}
+		buckets[k]++;
+		if (buckets[k] > most)
+			most = buckets[k];
+	}
+	for (int k = 0; k < BATCH_BUCKETS; k++) {
+		if (buckets[k] == 0)
+			continue;
+		char bar[41];
+		int len = (int)((double)buckets[k] / most * 40 + 0.5);
+		memset(bar, '#', len);
+		bar[len] = '\0';
+		fprintf(stderr, "< %8.0f us %-40s %d\n",
+				k == 0 ? 1.0 : (double)(1u << k), bar, buckets[k]);
+	}
+	free(sorted);
+}
+
+static void
+print_grid(FILE *f, struct SudokuGrid *g)
+{
+	char line[83];
+	for (int i = 0; i < 81; i++) {
+		line[i] = g->cells[i] ? '0' + g->cells[i] : '.';
+	}
+	line[81] = '\n';
+	line[82] = '\0';
+	fputs(line, f);
+}
+
+// The whole input, mapped if it's a regular file and read otherwise.
+static char *
+read_input(const char *path, size_t *len, bool *mapped)
+{
+	int fd = STDIN_FILENO;
+	if (path != NULL && strcmp(path, "-") != 0) {
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			perror(path);
+			exit(1);
+		}
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			if (fd != STDIN_FILENO)
+				close(fd);
+			*len = st.st_size;
+			*mapped = true;
+			return data;
+		}
+	}
+
+	size_t cap = 1 << 16;
+	char *data = malloc(cap);
+	*len = 0;
+	for (;;) {
+		if (data == NULL) {
+			perror("malloc");
+			exit(1);
+		}
+		ssize_t n = read(fd, data + *len, cap - *len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(path ? path : "stdin");
+			exit(1);
+		}
+		if (n == 0)
+			break;
+		*len += n;
+		if (*len == cap) {
+			cap *= 2;
+			data = realloc(data, cap);
+		}
+	}
+	if (fd != STDIN_FILENO)
+		close(fd);
+	*mapped = false;
+	return data;
+}
+
+// One puzzle per line, 81 cells with 1-9 for clues and 0 or . for empty
+// cells. Blank lines and lines starting with # are skipped.
+static void
+parse_input(struct Batch *b, const char *data, size_t len)
+{
+	int cap = 0;
+	for (size_t i = 0; i < len; i++) {
+		cap += data[i] == '\n';
+	}
+	cap++;
+	b->puzzles = xcalloc(cap, sizeof(*b->puzzles));
+	b->status = xcalloc(cap, sizeof(*b->status));
+
+	const char *p = data, *end = data + len;
+	while (p < end) {
+		const char *eol = memchr(p, '\n', end - p);
+		if (eol == NULL)
+			eol = end;
+		const char *line = p;
+		p = eol + 1;
+
+		if (eol - line > 0 && eol[-1] == '\r')
+			eol--;
+		if (line == eol || *line == '#')
+			continue;
+
+		uint8_t cells[81];
+		bool ok = eol - line >= 81;
+		for (int i = 0; ok && i < 81; i++) {
+			char c = line[i];
+			if (c == '.' || c == '0')
+				cells[i] = 0;
+			else if (c >= '1' && c <= '9')
+				cells[i] = c - '0';
+			else
+				ok = false;
+		}
+		int k = b->count++;
+		if (!ok || !sudoku_grid_load(&b->puzzles[k], cells))
+			b->status[k] = PUZZLE_INVALID;
+	}
+}
+
+static void
+batch_alloc_results(struct Batch *b)
+{
+	b->solutions = xcalloc(b->count > 0 ? b->count : 1, sizeof(*b->solutions));
+	b->times = xcalloc(b->count > 0 ? b->count : 1, sizeof(*b->times));
+}
+
+// Runs the sudoku engine without a window, mode is one of
+//   solve  print the solution of every puzzle read from path
+//   check  print how many solutions every puzzle has (none, unique, multiple)
+//   gen    generate count puzzles of every difficulty and print them
+// path is a file or NULL/"-" for stdin. Timings go to stderr. Returns the
+// exit status.
+int
+sudoku_batch(const char *mode, const char *path, int threads, int count,
+		uint32_t seed)
+{
+	struct Batch b = {0};
+	if (strcmp(mode, "solve") == 0) {
+		b.mode = BATCH_SOLVE;
+	} else if (strcmp(mode, "check") == 0) {
+		b.mode = BATCH_CHECK;
+	} else if (strcmp(mode, "gen") == 0) {
+		b.mode = BATCH_GEN;
+	} else {
+		fprintf(stderr, "unknown sudoku batch mode %s, expected solve, check or gen\n", mode);
+		return 1;
+	}
+	if (threads < 1)
+		threads = 1;
+
+	if (b.mode == BATCH_GEN) {
+		static const char *names[SUDOKU_DIFFICULTIES_COUNT] = {
+			"easy", "medium", "hard", "expert",
+		};
+		b.count = count;
+		b.seed = seed;
+		b.puzzles = xcalloc(count, sizeof(*b.puzzles));
+		b.status = xcalloc(count, sizeof(*b.status));
+		batch_alloc_results(&b);
+		for (int d = 0; d < SUDOKU_DIFFICULTIES_COUNT; d++) {
+			b.difficulty = d;
+			double wall = batch_run(&b, threads);
+			int hits = 0;
+			for (int i = 0; i < count; i++) {
+				print_grid(stdout, &b.puzzles[i]);
+				hits += b.status[i] == d;
+			}
+			char what[64];
+			snprintf(what, sizeof(what), "generated %s (%d graded %s)",
+					names[d], hits, names[d]);
+			print_stats(&b, what, wall, threads);
+		}
+	} else {
+		size_t len;
+		bool mapped;
+		char *data = read_input(path, &len, &mapped);
+		parse_input(&b, data, len);
+		if (mapped)
+			munmap(data, len);
+		else
+			free(data);
+		batch_alloc_results(&b);
+
+		double wall = batch_run(&b, threads);
+		int invalid = 0;
+		for (int i = 0; i < b.count; i++) {
+			if (b.status[i] == PUZZLE_INVALID) {
+				invalid++;
+				puts("invalid");
+			} else if (b.mode == BATCH_CHECK) {
+				puts(b.status[i] == 0 ? "none" :
+						b.status[i] == 1 ? "unique" : "multiple");
+			} else if (b.status[i] == 0) {
+				puts("unsolvable");
+			} else {
+				print_grid(stdout, &b.solutions[i]);
+			}
+		}
+		print_stats(&b, b.mode == BATCH_SOLVE ? "solved" : "checked",
+				wall, threads);
+		if (invalid > 0)
+			fprintf(stderr, "%d lines were not valid puzzles\n", invalid);
+	}
+
+	free(b.puzzles);
+	free(b.solutions);
+	free(b.status);
+	free(b.times);
+	return 0;
+}
@@ -0,0 +1,359 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tetris.h"
+
+#define SHAPE(left, top, w, h, m0, m1, m2, m3, ...) \
+	{ .cells = {__VA_ARGS__}, left, top, w, h, {m0, m1, m2, m3} }
+
+const struct TetrisShape tetris_shapes[TPIECES_COUNT][ROTS_COUNT] = {
+	[TPIECE_STRAIGHT] = {
+		[ROT_0]   = SHAPE(0, 0, 1, 4, 1, 1, 1, 1, {0,0}, {0,1}, {0,2}, {0,3}),
+		[ROT_90]  = SHAPE(-2, 0, 4, 1, 0xf, 0, 0, 0, {-2,0}, {-1,0}, {0,0}, {1,0}),
+		[ROT_180] = SHAPE(0, 0, 1, 4, 1, 1, 1, 1, {0,0}, {0,1}, {0,2}, {0,3}),
+		[ROT_270] = SHAPE(-2, 0, 4, 1, 0xf, 0, 0, 0, {-2,0}, {-1,0}, {0,0}, {1,0}),
+	},
+	[TPIECE_SQUARE] = {
+		[ROT_0]   = SHAPE(0, 0, 2, 2, 3, 3, 0, 0, {0,0}, {1,0}, {0,1}, {1,1}),
+		[ROT_90]  = SHAPE(0, 0, 2, 2, 3, 3, 0, 0, {0,0}, {1,0}, {0,1}, {1,1}),
+		[ROT_180] = SHAPE(0, 0, 2, 2, 3, 3, 0, 0, {0,0}, {1,0}, {0,1}, {1,1}),
+		[ROT_270] = SHAPE(0, 0, 2, 2, 3, 3, 0, 0, {0,0}, {1,0}, {0,1}, {1,1}),
+	},
+	[TPIECE_T] = {
+		[ROT_0]   = SHAPE(0, 0, 3, 2, 7, 2, 0, 0, {0,0}, {1,0}, {2,0}, {1,1}),
+		[ROT_90]  = SHAPE(0, 0, 2, 3, 1, 3, 1, 0, {0,0}, {0,1}, {0,2}, {1,1}),
+		[ROT_180] = SHAPE(0, 0, 3, 2, 2, 7, 0, 0, {0,1}, {1,1}, {2,1}, {1,0}),
+		[ROT_270] = SHAPE(0, 0, 2, 3, 2, 3, 2, 0, {1,0}, {1,1}, {1,2}, {0,1}),
+	},
+	[TPIECE_L] = {
+		[ROT_0]   = SHAPE(0, 0, 2, 3, 1, 1, 3, 0, {0,0}, {0,1}, {0,2}, {1,2}),
+		[ROT_90]  = SHAPE(0, 0, 3, 2, 4, 7, 0, 0, {0,1}, {1,1}, {2,1}, {2,0}),
+		[ROT_180] = SHAPE(0, 0, 2, 3, 3, 2, 2, 0, {1,0}, {1,1}, {1,2}, {0,0}),
+		[ROT_270] = SHAPE(0, 0, 3, 2, 7, 1, 0, 0, {0,0}, {1,0}, {2,0}, {0,1}),
+	},
+	[TPIECE_SKEW] = {
+		[ROT_0]   = SHAPE(0, 0, 3, 2, 3, 6, 0, 0, {0,0}, {1,0}, {1,1}, {2,1}),
+		[ROT_90]  = SHAPE(1, -1, 2, 3, 2, 3, 1, 0, {2,-1}, {1,0}, {2,0}, {1,1}),
+		[ROT_180] = SHAPE(0, 0, 3, 2, 3, 6, 0, 0, {0,0}, {1,0}, {1,1}, {2,1}),
+		[ROT_270] = SHAPE(1, -1, 2, 3, 2, 3, 1, 0, {2,-1}, {1,0}, {2,0}, {1,1}),
+	},
+	[TPIECE_L_MIRRORED] = {
+		[ROT_0]   = SHAPE(0, 0, 2, 3, 2, 2, 3, 0, {1,0}, {1,1}, {1,2}, {0,2}),
+		[ROT_90]  = SHAPE(0, 0, 3, 2, 1, 7, 0, 0, {2,1}, {1,1}, {0,1}, {0,0}),
+		[ROT_180] = SHAPE(0, 0, 2, 3, 3, 1, 1, 0, {0,0}, {0,1}, {0,2}, {1,0}),
+		[ROT_270] = SHAPE(0, 0, 3, 2, 7, 4, 0, 0, {2,0}, {1,0}, {0,0}, {2,1}),
+	},
+	[TPIECE_SKEW_MIRRORED] = {
+		[ROT_0]   = SHAPE(0, 0, 3, 2, 6, 3, 0, 0, {1,0}, {2,0}, {0,1}, {1,1}),
+		[ROT_90]  = SHAPE(1, -1, 2, 3, 1, 3, 2, 0, {1,-1}, {1,0}, {2,0}, {2,1}),
+		[ROT_180] = SHAPE(0, 0, 3, 2, 6, 3, 0, 0, {1,0}, {2,0}, {0,1}, {1,1}),
+		[ROT_270] = SHAPE(1, -1, 2, 3, 1, 3, 2, 0, {1,-1}, {1,0}, {2,0}, {2,1}),
+	},
+};
+#undef SHAPE
+
+// the long straight piece may need to move two cells off a wall.
+const struct TetrisKick tetris_kicks[TPIECES_COUNT][TETRIS_KICKS] = {
+	[TPIECE_STRAIGHT]      = {{0,0}, {-1,0}, {1,0}, {-2,0}, {2,0}},
+	[TPIECE_SQUARE]        = {{0,0}},
+	[TPIECE_T]             = {{0,0}, {-1,0}, {1,0}, {0,-1}},
+	[TPIECE_L]             = {{0,0}, {-1,0}, {1,0}, {0,-1}},
+	[TPIECE_SKEW]          = {{0,0}, {-1,0}, {1,0}, {0,-1}},
+	[TPIECE_L_MIRRORED]    = {{0,0}, {-1,0}, {1,0}, {0,-1}},
+	[TPIECE_SKEW_MIRRORED] = {{0,0}, {-1,0}, {1,0}, {0,-1}},
+};
+
+
+bool
+tetris_rotate(const uint16_t rows[TETRIS_HEIGHT], enum TetrisPiece piece,
+		enum Rotation rot, int *x, int *y)
+{
+	const struct TetrisKick *kicks = tetris_kicks[piece];
+	for (int i = 0; i < TETRIS_KICKS; i++) {
+		// the unused tail of the table is zeroed
+		if (i > 0 && kicks[i].x == 0 && kicks[i].y == 0)
+			break;
+		if (!tetris_collides(rows, piece, rot, *x + kicks[i].x, *y + kicks[i].y)) {
+			*x += kicks[i].x;
+			*y += kicks[i].y;
+			return true;
+		}
+	}
+	return false;
+}
+
+int
+tetris_drop(const uint16_t rows[TETRIS_HEIGHT], enum TetrisPiece piece,
+		enum Rotation rot, int x, int y)
+{
+	int dy = 0;
+	while (!tetris_collides(rows, piece, rot, x, y + dy + 1))
+		dy++;
+	return dy;
+}
+
+// Rotations that don't just repeat an earlier one.
+static bool
+distinct_rotation(enum TetrisPiece piece, enum Rotation rot)
+{
+	for (enum Rotation r = ROT_0; r < rot; r++) {
+		if (memcmp(&tetris_shapes[piece][r], &tetris_shapes[piece][rot],
+					sizeof(struct TetrisShape)) == 0)
+			return false;
+	}
+	return true;
+}
+
+// Adds the piece to rows and removes full lines, returns how many. Cells
+// above the board are lost.
+static int
+place(uint16_t rows[TETRIS_HEIGHT], enum TetrisPiece piece, enum Rotation rot,
+		int x, int y)
+{
+	const struct TetrisShape *shape = &tetris_shapes[piece][rot];
+	for (int i = 0; i < shape->height; i++) {
+		int row = y + shape->top + i;
+		if (row >= 0)
+			rows[row] |= shape->masks[i] << (x + shape->left);
+	}
+
+	int cleared = 0;
+	int to = TETRIS_HEIGHT - 1;
+	for (int row = TETRIS_HEIGHT - 1; row >= 0; row--) {
+		if (rows[row] == TETRIS_FULL_ROW)
+			cleared++;
+		else
+			rows[to--] = rows[row];
+	}
+	for (; to >= 0; to--)
+		rows[to] = 0;
+	return cleared;
+}
+
+// Pierre Dellacherie style weights, as tuned by Yiyuan Lee.
+#define BOT_HEIGHT    -0.510066
+#define BOT_LINES      0.760666
+#define BOT_HOLES     -0.35663
+#define BOT_BUMPINESS -0.184483
+
+static double
+evaluate(const uint16_t rows[TETRIS_HEIGHT], int lines)
+{
+	int heights[TETRIS_WIDTH] = {0};
+	int holes = 0;
+	uint16_t seen = 0;
+	for (int y = 0; y < TETRIS_HEIGHT; y++) {
+		holes += __builtin_popcount(seen & ~rows[y]);
+		for (uint16_t top = rows[y] & ~seen; top; top &= top - 1)
+			heights[__builtin_ctz(top)] = TETRIS_HEIGHT - y;
+		seen |= rows[y];
+	}
+
+	int height = heights[0];
+	int bumpiness = 0;
+	for (int x = 1; x < TETRIS_WIDTH; x++) {
+		height += heights[x];
+		bumpiness += abs(heights[x] - heights[x-1]);
+	}
+	return BOT_HEIGHT * height + BOT_LINES * lines +
+		BOT_HOLES * holes + BOT_BUMPINESS * bumpiness;
+}
+
+// Places the task's piece and scores every placement of the next piece on
+// top of it, the task keeps the best.
+static void
+run_task(struct TetrisBot *bot, struct TetrisTask *task)
+{
+	uint16_t first[TETRIS_HEIGHT];
+	memcpy(first, bot->rows, sizeof(first));
+	int y = task->y + tetris_drop(first, bot->piece, task->rotation, task->x, task->y);
+	int lines = place(first, bot->piece, task->rotation, task->x, y);
+
+	// nothing fits after this one, which loses the game.
+	task->score = evaluate(first, lines) - 1000;
+	task->evaluated = 1;
+
+	bool found = false;
+	enum TetrisPiece next = bot->next_piece;
+	for (int r = 0; r < ROTS_COUNT; r++) {
+		if (!distinct_rotation(next, r))
+			continue;
+		for (int x = -4; x < TETRIS_WIDTH; x++) {
+			if (tetris_collides(first, next, r, x, 0))
+				continue;
+			uint16_t second[TETRIS_HEIGHT];
+			memcpy(second, first, sizeof(second));
+			int y = tetris_drop(second, next, r, x, 0);
+			int more = place(second, next, r, x, y);
+			double score = evaluate(second, lines + more);
+			task->evaluated++;
+			if (!found || score > task->score) {
+				task->score = score;
+				found = true;
+			}
+		}
+	}
+}
+
+static void
+run_tasks(struct TetrisBot *bot)
+{
+	int t;
+	while ((t = atomic_fetch_add(&bot->next, 1)) < bot->tasks_len)
+		run_task(bot, &bot->tasks[t]);
+}
+
+static void *
+bot_worker(void *arg)
+{
+	struct TetrisBot *bot = arg;
+	int generation = 0;
+
+	pthread_mutex_lock(&bot->lock);
+	for (;;) {
+		while (!bot->quit && bot->generation == generation)
+			pthread_cond_wait(&bot->work, &bot->lock);
+		if (bot->quit)
+			break;
+		generation = bot->generation;
+		pthread_mutex_unlock(&bot->lock);
+
+		run_tasks(bot);
+
+		pthread_mutex_lock(&bot->lock);
+		if (--bot->working == 0)
+			pthread_cond_signal(&bot->done);
+	}
+	pthread_mutex_unlock(&bot->lock);
+	return NULL;
+}
+
+struct TetrisBot *
+tetris_bot_create(int threads)
+{
+	struct TetrisBot *bot = calloc(1, sizeof(*bot));
+	if (bot == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	bot->threads_len = threads > 1 ? threads - 1 : 0;
+	bot->threads = calloc(bot->threads_len + 1, sizeof(*bot->threads));
+	if (bot->threads == NULL) {
+		perror("calloc");
+		exit(1);
+	}
+	pthread_mutex_init(&bot->lock, NULL);
+	pthread_cond_init(&bot->work, NULL);
+	pthread_cond_init(&bot->done, NULL);
+
+	for (int i = 0; i < bot->threads_len; i++) {
+		int err = pthread_create(&bot->threads[i], NULL, bot_worker, bot);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(1);
+		}
+	}
+	return bot;
+}
+
+void
+tetris_bot_destroy(struct TetrisBot *bot)
+{
+	if (bot == NULL)
+		return;
+
+	pthread_mutex_lock(&bot->lock);
+	bot->quit = true;
+	pthread_cond_broadcast(&bot->work);
+	pthread_mutex_unlock(&bot->lock);
+	for (int i = 0; i < bot->threads_len; i++) {
+		pthread_join(bot->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&bot->done);
+	pthread_cond_destroy(&bot->work);
+	pthread_mutex_destroy(&bot->lock);
+	free(bot->threads);
+	free(bot);
+}
+
+static double
+seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// A placement is reachable if the piece can be turned to its rotation from
+// where it is, one step at a time like the z key does, and then slide
+// there without hitting anything.
+bool
+tetris_bot_search(struct TetrisBot *bot, const uint16_t rows[TETRIS_HEIGHT],
+		enum TetrisPiece piece, enum Rotation rot, int x, int y,
+		enum TetrisPiece next, struct TetrisMove *move)
+{
+	double start = seconds();
+
+	memcpy(bot->rows, rows, sizeof(bot->rows));
+	bot->piece = piece;
+	bot->next_piece = next;
+	bot->tasks_len = 0;
+	for (int i = 0; i < ROTS_COUNT; i++) {
+		enum Rotation r = (rot + i) % ROTS_COUNT;
+		int rx = x, ry = y;
+		bool reachable = !tetris_collides(rows, piece, rot, x, y);
+		for (enum Rotation from = rot; reachable && from != r; from = (from + 1) % ROTS_COUNT) {
+			reachable = tetris_rotate(rows, piece, (from + 1) % ROTS_COUNT, &rx, &ry);
+		}
+		if (!reachable || !distinct_rotation(piece, r))
+			continue;
+
+		int left = rx;
+		while (!tetris_collides(rows, piece, r, left - 1, ry))
+			left--;
+		for (int tx = left; !tetris_collides(rows, piece, r, tx, ry); tx++) {
+			bot->tasks[bot->tasks_len++] = (struct TetrisTask){
+				.rotation = r,
+				.x = tx,
+				.y = ry,
+			};
+		}
+	}
+	if (bot->tasks_len == 0)
+		return false;
+
+	pthread_mutex_lock(&bot->lock);
+	atomic_store(&bot->next, 0);
+	bot->working = bot->threads_len;
+	bot->generation++;
+	pthread_cond_broadcast(&bot->work);
+	pthread_mutex_unlock(&bot->lock);
+
+	run_tasks(bot);
+
+	pthread_mutex_lock(&bot->lock);
+	while (bot->working > 0)
+		pthread_cond_wait(&bot->done, &bot->lock);
+	pthread_mutex_unlock(&bot->lock);
+
+	// ties go to the first task, so the thread count doesn't matter.
+	struct TetrisTask *best = &bot->tasks[0];
+	for (int t = 0; t < bot->tasks_len; t++) {
+		struct TetrisTask *task = &bot->tasks[t];
+		if (task->score > best->score)
+			best = task;
+		bot->evaluated += task->evaluated;
+	}
+	*move = (struct TetrisMove){
+		.rotation = best->rotation,
+		.x = best->x,
+		.score = best->score,
+	};
+	bot->elapsed += seconds() - start;
+	return true;
+}
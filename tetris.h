@@ -0,0 +1,137 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Tetromino geometry and the autoplay bot, shared by the game and anything
+// that wants to search placements. Boards are bare bitboards here, one
+// uint16_t per row with bit x set for an occupied cell at column x.
+
+enum TetrisPiece {
+	// https://en.wikipedia.org/wiki/Tetromino#Free_tetrominoes
+	TPIECE_STRAIGHT,
+	TPIECE_SQUARE,
+	TPIECE_T,
+	TPIECE_L,
+	TPIECE_SKEW,
+	TPIECE_L_MIRRORED,
+	TPIECE_SKEW_MIRRORED,
+	TPIECES_COUNT,
+};
+enum Rotation {
+	ROT_0,
+	ROT_90,
+	ROT_180,
+	ROT_270,
+	ROTS_COUNT,
+};
+
+#define TETRIS_HEIGHT 20
+#define TETRIS_WIDTH 10
+_Static_assert(TETRIS_WIDTH > 4, "TETRIS_WIDTH must be at least 4");
+_Static_assert(TETRIS_WIDTH <= 16, "a tetris row must fit in 16 bits");
+#define TETRIS_FULL_ROW ((uint16_t)((1u << TETRIS_WIDTH) - 1))
+_Static_assert(TETRIS_HEIGHT <= 32, "cleared rows must fit in 32 bits");
+
+// A piece in one rotation, relative to its position. Bit i of masks[r] is
+// the cell at (left + i, top + r).
+struct TetrisShape {
+	struct { int x, y; } cells[4];
+	int left, top;
+	int width, height;
+	uint16_t masks[4];
+};
+
+#define TETRIS_KICKS 5
+
+// Offsets tried in order when a rotation collides.
+struct TetrisKick {
+	int x, y;
+};
+
+extern const struct TetrisShape tetris_shapes[TPIECES_COUNT][ROTS_COUNT];
+extern const struct TetrisKick tetris_kicks[TPIECES_COUNT][TETRIS_KICKS];
+
+// Whether the piece at (x, y) overlaps the walls, the floor or a cell of
+// rows. Cells above the board never collide.
+static inline bool
+tetris_collides(const uint16_t rows[TETRIS_HEIGHT], enum TetrisPiece piece,
+		enum Rotation rot, int x, int y)
+{
+	const struct TetrisShape *shape = &tetris_shapes[piece][rot];
+	x += shape->left;
+	if (x < 0 || x + shape->width > TETRIS_WIDTH)
+		return true;
+	y += shape->top;
+	for (int i = 0; i < shape->height; i++) {
+		if (y + i < 0)
+			continue;
+		if (y + i >= TETRIS_HEIGHT || (rows[y + i] & shape->masks[i] << x))
+			return true;
+	}
+	return false;
+}
+
+// Turns the piece at (*x, *y) to rot, moving it by the first kick that fits.
+// The kicks don't depend on the rotation it comes from. Returns false and
+// leaves the position alone if none fits.
+bool tetris_rotate(const uint16_t rows[TETRIS_HEIGHT], enum TetrisPiece piece,
+		enum Rotation rot, int *x, int *y);
+
+// How far the piece at (x, y) falls before it lands.
+int tetris_drop(const uint16_t rows[TETRIS_HEIGHT], enum TetrisPiece piece,
+		enum Rotation rot, int x, int y);
+
+// Where the bot wants the falling piece to end up, x and rotation are in
+// the same terms as struct Tetris curPos and rotation.
+struct TetrisMove {
+	enum Rotation rotation;
+	int x;
+	double score;
+};
+
+// every (rotation, column) of the falling piece the bot looks at.
+#define TETRIS_BOT_TASKS (ROTS_COUNT * TETRIS_WIDTH)
+
+// One placement of the falling piece and the best score reached with the
+// next piece on top of it.
+struct TetrisTask {
+	enum Rotation rotation;
+	int x, y;
+	double score;
+	uint64_t evaluated;
+};
+
+struct TetrisBot {
+	pthread_t *threads;
+	int threads_len;
+	pthread_mutex_t lock;
+	// signals the workers that a search started or they should quit,
+	// and the searching thread that every worker is done.
+	pthread_cond_t work;
+	pthread_cond_t done;
+	bool quit;
+	int generation;
+	int working;
+
+	// The search in progress, tasks are handed out through next.
+	uint16_t rows[TETRIS_HEIGHT];
+	enum TetrisPiece piece;
+	enum TetrisPiece next_piece;
+	struct TetrisTask tasks[TETRIS_BOT_TASKS];
+	int tasks_len;
+	atomic_int next;
+
+	// totals over every search, for placements per second.
+	uint64_t evaluated;
+	double elapsed;
+};
+
+// threads includes the one calling tetris_bot_search.
+struct TetrisBot *tetris_bot_create(int threads);
+void tetris_bot_destroy(struct TetrisBot *bot);
+// Finds the best placement for piece at (x, y) looking one piece ahead,
+// returns false if it can't be placed at all.
+bool tetris_bot_search(struct TetrisBot *bot, const uint16_t rows[TETRIS_HEIGHT],
+		enum TetrisPiece piece, enum Rotation rot, int x, int y,
+		enum TetrisPiece next, struct TetrisMove *move);